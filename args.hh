@@ -3,14 +3,18 @@
 #include <iostream>
 #include <functional>
 #include <map>
+#include <optional>
+#include <string>
 #include <variant>
+#include <vector>
 
 class ArgumentParser {
 public:
     struct NoArg{};
     using Parsed = std::variant<
         bool,
-        double
+        double,
+        std::string
     >;
 
     using Callback = std::function<void(const Parsed& parsed)>;
@@ -53,8 +57,13 @@ public:
     }
 
     void parse(int argc, const char** argv) {
-        for (int i = 1; i < argc; ++i) {
-            std::string arg(argv[i]);
+        parse(std::vector<std::string>(argv + 1, argv + argc));
+    }
+
+    // Parses arguments (without the program name), later arguments override earlier ones.
+    void parse(const std::vector<std::string>& argv) {
+        for (size_t i = 0; i < argv.size(); ++i) {
+            const std::string& arg = argv[i];
 
             auto arg_it = args_.find(arg);
             if (arg_it == args_.end()) {
@@ -63,7 +72,7 @@ public:
 
             if (arg_it->second.is_flag) {
                 arg_it->second.value = true;
-            } else if (i + 1 < argc){
+            } else if (i + 1 < argv.size()){
                 if(auto parsed = parse_arg(argv[i + 1])) {
                     arg_it->second.value = parsed.value();
                 }
@@ -80,12 +89,18 @@ public:
                 } else {
                     help("Argument '" + name + "' is missing argument");
                 }
-            } catch(const std::runtime_error& ex) {
+            } catch(const std::exception& ex) {
                 help("Exception when handling '" + name + "': " + ex.what());
             }
         }
     }
 
+    bool has_argument(const std::string& name) const { return args_.count(name) > 0; }
+    bool is_flag(const std::string& name) const { return args_.at(name).is_flag; }
+
+    // The value an argument ended up with once parsed (or its default), if it has one.
+    const std::optional<Parsed>& value(const std::string& name) const { return args_.at(name).value; }
+
     void add_argument(std::string name, Argument arg) {
         if (name.empty() || !name.at(0)) {
             throw std::runtime_error("Invalid argument name '" + name + "' must start with '-'");
@@ -96,18 +111,23 @@ public:
 private:
     std::optional<Parsed> parse_arg(const std::string& str) const {
         try {
-            return std::stod(str);
+            size_t parsed = 0;
+            double value = std::stod(str, &parsed);
+            if (parsed == str.size()) {
+                return value;
+            }
         } catch (const std::invalid_argument& ex) {
             // assume its something else
         }
 
-        return std::nullopt;
+        return str;
     }
 
     std::string format_arg(const Parsed& parsed) const {
         struct Visitor {
             std::string operator()(const double& v) const { return std::to_string(v); }
             std::string operator()(const bool& v) const { return std::to_string(v); }
+            std::string operator()(const std::string& v) const { return v; }
         };
         return std::visit(Visitor{}, parsed);
     }
@@ -0,0 +1,824 @@
+#pragma once
+
+#include "kernel.hh"
+#include "market_data.hh"
+#include "policy.hh"
+#include "taxes.hh"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Starting state and per step cash flows of a single fund.
+struct BatchFund {
+    double amount = 0.0;
+
+    // Nothing can be sold from the fund before this year.
+    double start = 0.0;
+
+    // When set the growth is looked up at each simulation's offset, otherwise the growth per step is fixed.
+    const MarketData* market = nullptr;
+    std::vector<double> growth;
+
+    // Amount bought on each step.
+    std::vector<double> contributed;
+
+    // How withdrawals are taxed, when the schedule is taxed. The starting amount is all cost basis.
+    Account account = Account::TAXABLE;
+};
+
+//
+// Cash flows for a single scenario which don't depend on the market offset (income, expenses and contributions), so
+// they can be computed once and shared by every simulation in a batch.
+//
+struct Schedule {
+    // The year of each step, and the year market funds look ahead to on that step (see MarketFund::update_amount)
+    std::vector<double> years;
+    std::vector<double> ahead;
+
+    // Amount which needs to be withdrawn from the funds on each step, and how much of it the spending model planned
+    // (which a spending policy can change).
+    std::vector<double> to_spend;
+    std::vector<double> spending;
+
+    // First step without any income, which is where the retirement value gets recorded.
+    std::optional<size_t> retirement_step;
+
+    // In withdrawl order.
+    std::vector<BatchFund> funds;
+
+    // How the funds are drawn on, only the default can run on a generated kernel.
+    Policy policy;
+
+    //
+    // Income tax, if the scenario is taxed. Tax on the salary is part of to_spend, while tax on withdrawals depends
+    // on the market so is worked out by the engine: at the end of each tax year its withdrawals are stacked on top of
+    // the salary taxed that year (taxed_income being the year's salary so far on each step).
+    //
+    std::optional<Taxes> taxes;
+    std::vector<double> taxed_income;
+
+    // Steps starting a new year, when the tax year and any yearly spending policy start over.
+    std::vector<uint8_t> new_year;
+
+    size_t steps() const { return years.size(); }
+};
+
+//
+// How balances are represented in the batched engine. Floating point balances are grown exactly as the funds do.
+//
+template <typename Scalar>
+struct Money {
+    // Type market prices are held in while growing balances.
+    using Price = Scalar;
+
+    // Marks a value which was never recorded.
+    static constexpr Scalar NONE = std::numeric_limits<Scalar>::quiet_NaN();
+
+    static Scalar from_dollars(double dollars) { return dollars; }
+    static double to_dollars(Scalar amount) { return amount; }
+
+    static Scalar grow(Scalar amount, double growth) { return amount * static_cast<Scalar>(growth); }
+    static Scalar grow(Scalar amount, Price ahead, Price now) { return ahead * amount / now; }
+};
+
+//
+// Exact integer cents. Growth is applied as a fixed point multiply with rounding, so results only depend on the
+// inputs, not on the vector width, compiler or the order things are summed in.
+//
+using Cents = int64_t;
+
+template <>
+struct Money<Cents> {
+    using Price = double;
+
+    static constexpr Cents NONE = std::numeric_limits<Cents>::min();
+
+    // Fractional bits in the fixed point growth factors, 30 keeps the partial products below within 64 bits.
+    static constexpr int GROWTH_BITS = 30;
+    static constexpr Cents GROWTH_MASK = (Cents{1} << GROWTH_BITS) - 1;
+
+    static Cents from_dollars(double dollars) { return std::llround(dollars * 100.0); }
+    static double to_dollars(Cents amount) {
+        return amount == NONE ? std::numeric_limits<double>::quiet_NaN() : amount / 100.0;
+    }
+
+    static Cents grow(Cents amount, double growth) {
+        // Balances are never negative and growth factors are positive, so rounding half up is just a truncation.
+        const Cents fixed = growth * (Cents{1} << GROWTH_BITS) + 0.5;
+
+        // amount * fixed >> GROWTH_BITS, split so neither product can overflow for balances below 2^33 dollars.
+        const Cents high = amount >> GROWTH_BITS;
+        const Cents low = amount & GROWTH_MASK;
+        return high * fixed + ((low * fixed + (Cents{1} << (GROWTH_BITS - 1))) >> GROWTH_BITS);
+    }
+    static Cents grow(Cents amount, Price ahead, Price now) { return grow(amount, ahead / now); }
+};
+
+//
+// What a generated kernel (see BatchEngine::kernel_source()) is handed on each step of a block, one pointer per lane
+// array. The funds of every schedule are in order, one after another.
+//
+template <typename Scalar>
+struct KernelArgs {
+    size_t step = 0;
+    const Schedule* const* schedules = nullptr;
+
+    const typename Money<Scalar>::Price* const* now = nullptr;
+    const typename Money<Scalar>::Price* const* ahead = nullptr;
+
+    Scalar* const* amounts = nullptr;
+    Scalar* const* retirements = nullptr;
+    uint8_t* const* bankrupts = nullptr;
+};
+
+template <typename Scalar>
+struct BatchResults {
+    std::vector<Scalar> final;
+    std::vector<Scalar> retirement;
+    std::vector<uint8_t> bankrupt;
+
+    size_t size() const { return final.size(); }
+};
+
+//
+// Runs one scenario at many market offsets at once. Fund balances are stored lane-wise so each step is a handful of
+// flat loops over the simulations in a block. Scalar is the type used for the balances, float doubles the number of
+// lanes per vector (and halves the memory traffic) at the cost of some accuracy, while Cents is exact.
+//
+// Several schedules (with the same steps) can also be run together, each step of a block then looks up the market
+// prices once and applies them to every schedule while they're still in L1.
+//
+template <typename Scalar>
+class BatchEngine {
+public:
+    // How many simulations to run together, the state for a block should stay well within L1.
+    static constexpr size_t LANES = 64;
+
+    explicit BatchEngine(const Schedule& schedule) : BatchEngine(std::vector<const Schedule*>{&schedule}) {}
+
+    explicit BatchEngine(std::vector<const Schedule*> schedules) : schedules_(std::move(schedules)) {
+        if (schedules_.empty()) {
+            throw std::runtime_error("BatchEngine needs at least one schedule.");
+        }
+
+        const Schedule& steps = *schedules_.front();
+        for (const Schedule* schedule : schedules_) {
+            if (schedule->years != steps.years || schedule->ahead != steps.ahead) {
+                throw std::runtime_error("Schedules run together need the same steps.");
+            }
+
+            auto& fund_markets = fund_markets_.emplace_back();
+            for (const BatchFund& fund : schedule->funds) {
+                auto it = std::find(markets_.begin(), markets_.end(), fund.market);
+                if (fund.market && it == markets_.end()) {
+                    it = markets_.insert(it, fund.market);
+                }
+                fund_markets.push_back(it - markets_.begin());
+            }
+
+            auto& order = sell_orders_.emplace_back(schedule->policy.order);
+            if (order.empty()) {
+                for (size_t f = 0; f < schedule->funds.size(); ++f) {
+                    order.push_back(f);
+                }
+            }
+            std::vector<size_t> sorted = order;
+            std::sort(sorted.begin(), sorted.end());
+            bool valid = sorted.size() == schedule->funds.size();
+            for (size_t f = 0; f < sorted.size(); ++f) {
+                valid &= sorted[f] == f;
+            }
+            if (!valid) {
+                throw std::runtime_error("A policy's sell order needs every fund exactly once.");
+            }
+        }
+
+        // Kernels only cover untaxed schedules with fixed spending (in any sell order).
+        const bool generic = std::any_of(schedules_.begin(), schedules_.end(), [](const Schedule* schedule) {
+            return schedule->taxes.has_value() || !schedule->policy.fixed();
+        });
+        if (KernelCache::enabled() && !generic) {
+            kernel_ = reinterpret_cast<Kernel>(KernelCache::find(kernel_source(), "lifesim_kernel"));
+        }
+    }
+
+    // If this engine runs on a kernel generated for its shape, rather than the generic step.
+    bool specialized() const { return kernel_ != nullptr; }
+
+    //
+    // Source for a kernel doing a step of a block for every schedule, specialized to the shape of the schedules:
+    // the number of funds in each and which market (if any) each fund grows with. Everything else is read from the
+    // schedules as the step runs, so one kernel can run any schedules of the same shape.
+    //
+    // Knowing the funds up front, each lane is taken through the whole step (growth, contributions, then selling fund
+    // by fund) in a single pass with the balances in registers, where the generic step makes a pass over the lanes
+    // per fund per stage. Every lane still sees the same operations in the same order, so results are identical.
+    //
+    // The kernel is compiled against whatever batch.hh is next to kernel.hh when it's built, so it starts by asserting
+    // the layout of what it reads matches this build's. Headers changed since then fail to compile, and the engine
+    // falls back to the generic step rather than reading the wrong fields.
+    //
+    std::string kernel_source() const {
+        std::ostringstream source;
+        source << "#include \"batch.hh\"\n\n"
+               << "#include <cstddef>\n\n"
+               << "using Scalar = " << scalar_name() << ";\n"
+               << "using M = Money<Scalar>;\n"
+               << "using Price = M::Price;\n\n"
+               << layout_asserts() << "\n"
+               << "extern \"C\" void lifesim_kernel(const KernelArgs<Scalar>& args) {\n"
+               << "    const size_t i = args.step;\n";
+
+        size_t first_fund = 0;
+        for (size_t s = 0; s < schedules_.size(); ++s) {
+            const auto& funds = schedules_[s]->funds;
+            source << "\n    {\n"
+                   << "        const Schedule& schedule = *args.schedules[" << s << "];\n"
+                   << "        const bool retire = schedule.retirement_step == i;\n"
+                   << "        const Scalar to_spend = M::from_dollars(schedule.to_spend[i]);\n"
+                   << "        Scalar* __restrict retirement = args.retirements[" << s << "];\n"
+                   << "        uint8_t* __restrict bankrupt = args.bankrupts[" << s << "];\n";
+            for (size_t f = 0; f < funds.size(); ++f) {
+                const std::string fund = "schedule.funds[" + std::to_string(f) + "]";
+                source << "        Scalar* __restrict amount" << f << " = args.amounts[" << first_fund + f << "];\n"
+                       << "        const Scalar contributed" << f << " = M::from_dollars(" << fund << ".contributed[i]);\n"
+                       << "        const bool sell" << f << " = !(schedule.years[i] < " << fund << ".start);\n";
+                if (funds[f].market) {
+                    const size_t m = fund_markets_[s][f];
+                    source << "        const Price* __restrict now" << f << " = args.now[" << m << "];\n"
+                           << "        const Price* __restrict ahead" << f << " = args.ahead[" << m << "];\n";
+                } else {
+                    source << "        const double growth" << f << " = " << fund << ".growth[i];\n";
+                }
+            }
+
+            source << "        for (size_t l = 0; l < " << LANES << "; ++l) {\n"
+                   << "            if (retire) retirement[l] = Scalar(0)";
+            for (size_t f = 0; f < funds.size(); ++f) {
+                source << " + amount" << f << "[l]";
+            }
+            source << ";\n";
+            for (size_t f = 0; f < funds.size(); ++f) {
+                source << "            Scalar a" << f << " = M::grow(amount" << f << "[l], "
+                       << (funds[f].market ? "ahead" + std::to_string(f) + "[l], now" + std::to_string(f) + "[l]"
+                                           : "growth" + std::to_string(f))
+                       << ");\n"
+                       << "            a" << f << " += contributed" << f << ";\n";
+            }
+            source << "            Scalar spend = to_spend;\n";
+            for (size_t f : sell_orders_[s]) {
+                source << "            if (sell" << f << ") { const Scalar sold = a" << f << " >= spend ? spend : a" << f
+                       << "; a" << f << " -= sold; spend -= sold; }\n"
+                       << "            amount" << f << "[l] = a" << f << ";\n";
+            }
+            source << "            bankrupt[l] |= spend > 0;\n"
+                   << "        }\n"
+                   << "    }\n";
+            first_fund += funds.size();
+        }
+        source << "}\n";
+        return source.str();
+    }
+
+    BatchResults<Scalar> run(const std::vector<double>& percents) const { return std::move(run_all(percents).front()); }
+
+    // Results for each of the schedules.
+    std::vector<BatchResults<Scalar>> run_all(const std::vector<double>& percents) const {
+        auto results = allocate(percents.size());
+        run_range(percents, 0, percents.size(), results.data());
+        return results;
+    }
+
+    // Results sized for count simulations of each schedule.
+    std::vector<BatchResults<Scalar>> allocate(size_t count) const {
+        std::vector<BatchResults<Scalar>> results(schedules_.size());
+        for (auto& result : results) {
+            result.final.resize(count);
+            result.retirement.resize(count);
+            result.bankrupt.resize(count);
+        }
+        return results;
+    }
+
+    //
+    // Runs the simulations [first, last) of the percents, writing the results (one per schedule) at the same indices.
+    // Separate ranges can be run at the same time.
+    //
+    void run_range(const std::vector<double>& percents, size_t first, size_t last, BatchResults<Scalar>* results) const {
+        for (; first < last; first += LANES) {
+            const size_t count = std::min(LANES, last - first);
+            run_block(count, first, results, offset_lookup(percents.data() + first, count));
+        }
+    }
+
+    //
+    // Runs the block of simulations holding percents[index], calling observe(i, amounts, bankrupt) after each step i
+    // with the fund balances (in dollars) and bankrupt state of that simulation on the given schedule. This is for
+    // checking the engine step by step against the reference, so it's run through exactly what run_range() does.
+    //
+    template <typename Observe>
+    BatchResults<Scalar> trace(const std::vector<double>& percents,
+                               size_t index,
+                               size_t schedule,
+                               const Observe& observe) const {
+        auto results = allocate(percents.size());
+        const size_t first = index - index % LANES;
+        const size_t count = std::min(LANES, percents.size() - first);
+        const size_t lane = index - first;
+
+        std::vector<double> dollars(schedules_[schedule]->funds.size());
+        run_block(count, first, results.data(), offset_lookup(percents.data() + first, count),
+                  [&](size_t i, const auto& amounts, const auto& bankrupts) {
+                      for (size_t f = 0; f < dollars.size(); ++f) {
+                          dollars[f] = Money<Scalar>::to_dollars(amounts[schedule][f][lane]);
+                      }
+                      observe(i, dollars, bankrupts[schedule][lane] != 0);
+                  });
+        return std::move(results[schedule]);
+    }
+
+    //
+    // Runs count whole day offsets, starting from first_day and spaced stride days apart. Since every simulation is on a
+    // whole day, the day of each lookup is the offset plus a step dependent (but simulation independent) number of
+    // days. So each market is expanded (through the wrap-around) into a flat table once, and every step of a block
+    // reads straight runs out of it rather than doing a lookup per simulation.
+    //
+    BatchResults<Scalar> run_days(size_t first_day, size_t count, size_t stride) const {
+        auto results = allocate(count);
+        if (count == 0) {
+            return std::move(results.front());
+        }
+
+        const Schedule& steps = *schedules_.front();
+        std::vector<size_t> now_days(steps.steps());
+        std::vector<size_t> ahead_days(steps.steps());
+        size_t last_day = 0;
+        for (size_t i = 0; i < steps.steps(); ++i) {
+            now_days[i] = std::floor(steps.years[i] * 365.25);
+            ahead_days[i] = std::floor(steps.ahead[i] * 365.25);
+            last_day = std::max({last_day, now_days[i], ahead_days[i]});
+        }
+        last_day += first_day + (count - 1) * stride;
+
+        std::map<const MarketData*, std::vector<typename Money<Scalar>::Price>> tables;
+        for (const MarketData* market : markets_) {
+            auto& table = tables[market];
+            table.resize(last_day + 1);
+            for (size_t day = 0; day <= last_day; ++day) {
+                table[day] = market->lookup(day);
+            }
+        }
+
+        for (size_t first = 0; first < count; first += LANES) {
+            const size_t block_count = std::min(LANES, count - first);
+            const size_t block_day = first_day + first * stride;
+            run_block(block_count, first, results.data(), [&](const MarketData& market, size_t i, Prices& now, Prices& ahead) {
+                const auto* table = tables.at(&market).data();
+                const auto* now_table = table + block_day + now_days[i];
+                const auto* ahead_table = table + block_day + ahead_days[i];
+                for (size_t l = 0; l < block_count; ++l) {
+                    now[l] = now_table[l * stride];
+                    ahead[l] = ahead_table[l * stride];
+                }
+            });
+        }
+        return std::move(results.front());
+    }
+
+private:
+    using Lanes = std::array<Scalar, LANES>;
+    using Prices = std::array<typename Money<Scalar>::Price, LANES>;
+
+    using Kernel = void (*)(const KernelArgs<Scalar>&);
+
+    // This build's sizes and offsets of everything a kernel reads, as static_asserts for its source.
+    static std::string layout_asserts() {
+        std::ostringstream out;
+        auto expect = [&out](const char* expression, size_t value) {
+            out << "static_assert(" << expression << " == " << value << ");\n";
+        };
+        expect("sizeof(Schedule)", sizeof(Schedule));
+        expect("offsetof(Schedule, years)", offsetof(Schedule, years));
+        expect("offsetof(Schedule, to_spend)", offsetof(Schedule, to_spend));
+        expect("offsetof(Schedule, retirement_step)", offsetof(Schedule, retirement_step));
+        expect("offsetof(Schedule, funds)", offsetof(Schedule, funds));
+        expect("sizeof(BatchFund)", sizeof(BatchFund));
+        expect("offsetof(BatchFund, start)", offsetof(BatchFund, start));
+        expect("offsetof(BatchFund, growth)", offsetof(BatchFund, growth));
+        expect("offsetof(BatchFund, contributed)", offsetof(BatchFund, contributed));
+        expect("sizeof(KernelArgs<Scalar>)", sizeof(KernelArgs<Scalar>));
+        expect("offsetof(KernelArgs<Scalar>, step)", offsetof(KernelArgs<Scalar>, step));
+        expect("offsetof(KernelArgs<Scalar>, schedules)", offsetof(KernelArgs<Scalar>, schedules));
+        expect("offsetof(KernelArgs<Scalar>, now)", offsetof(KernelArgs<Scalar>, now));
+        expect("offsetof(KernelArgs<Scalar>, ahead)", offsetof(KernelArgs<Scalar>, ahead));
+        expect("offsetof(KernelArgs<Scalar>, amounts)", offsetof(KernelArgs<Scalar>, amounts));
+        expect("offsetof(KernelArgs<Scalar>, retirements)", offsetof(KernelArgs<Scalar>, retirements));
+        expect("offsetof(KernelArgs<Scalar>, bankrupts)", offsetof(KernelArgs<Scalar>, bankrupts));
+        return out.str();
+    }
+
+    static const char* scalar_name() {
+        if constexpr (std::is_same_v<Scalar, Cents>) {
+            return "Cents";
+        } else if constexpr (std::is_same_v<Scalar, float>) {
+            return "float";
+        } else {
+            return "double";
+        }
+    }
+
+    // Per lane tax state of a taxed schedule for the current tax year, in dollars whatever the balances are in.
+    struct TaxLanes {
+        using Dollars = std::array<double, LANES>;
+
+        // Pre-tax withdrawals (on top of the salary) and realized capital gains so far this tax year, and capital
+        // losses carried from earlier years.
+        Dollars ordinary{};
+        Dollars gains{};
+        Dollars carried{};
+
+        // Owed for the last tax year, paid with the next step.
+        Dollars due{};
+
+        // Scratch space for working out the tax.
+        Dollars income{};
+        Dollars total{};
+        Dollars tax{};
+
+        // Cost basis of each fund.
+        std::vector<Lanes> basis;
+    };
+
+    // Per lane state of a schedule's spending policy, in dollars.
+    struct PolicyLanes {
+        using Dollars = std::array<double, LANES>;
+
+        // What the guardrails have scaled the spending to.
+        Dollars scale{};
+
+        // What PERCENT spends over this year, and what's been spent so far this year.
+        Dollars budget{};
+        Dollars withdrawn{};
+
+        // Scratch space for the portfolio total and this step's spending.
+        Dollars total{};
+        Dollars spent{};
+    };
+
+    struct Unobserved {
+        template <typename... Args>
+        void operator()(const Args&...) const {}
+    };
+
+    // Looks up the prices for a block of simulations at any offset (as a fraction of each market's data).
+    auto offset_lookup(const double* block, size_t count) const {
+        return [this, block, count](const MarketData& market, size_t i, Prices& now, Prices& ahead) {
+            const Schedule& steps = *schedules_.front();
+            const double size = market.size();
+            for (size_t l = 0; l < count; ++l) {
+                const double day_offset = block[l] * size;
+                now[l] = market.lookup(steps.years[i] * 365.25 + day_offset);
+                ahead[l] = market.lookup(steps.ahead[i] * 365.25 + day_offset);
+            }
+        };
+    }
+
+    //
+    // The lookup fills in the now and ahead prices of the first count lanes for the given market and step, and the
+    // observer sees every schedule's balances and bankrupt lanes after each step.
+    //
+    template <typename Lookup, typename Observe = Unobserved>
+    void run_block(size_t count,
+                   size_t first,
+                   BatchResults<Scalar>* results,
+                   const Lookup& lookup,
+                   const Observe& observe = {}) const {
+        const Schedule& steps = *schedules_.front();
+
+        std::vector<std::vector<Lanes>> amounts(schedules_.size());
+        std::vector<Lanes> retirements(schedules_.size());
+        std::vector<std::array<uint8_t, LANES>> bankrupts(schedules_.size());
+        for (size_t s = 0; s < schedules_.size(); ++s) {
+            const auto& funds = schedules_[s]->funds;
+            amounts[s].resize(funds.size());
+            for (size_t f = 0; f < funds.size(); ++f) {
+                amounts[s][f].fill(Money<Scalar>::from_dollars(funds[f].amount));
+            }
+            retirements[s].fill(Money<Scalar>::NONE);
+            bankrupts[s].fill(0);
+        }
+
+        std::vector<TaxLanes> taxes(schedules_.size());
+        for (size_t s = 0; s < schedules_.size(); ++s) {
+            if (schedules_[s]->taxes) {
+                taxes[s].basis = amounts[s];
+            }
+        }
+
+        std::vector<PolicyLanes> policies(schedules_.size());
+        for (auto& policy : policies) {
+            policy.scale.fill(1.0);
+        }
+
+        std::vector<Prices> now(markets_.size());
+        std::vector<Prices> ahead(markets_.size());
+        Lanes spend{};
+
+        // Pointers to all of the above, for the kernel.
+        KernelArgs<Scalar> args;
+        std::vector<const typename Money<Scalar>::Price*> now_lanes, ahead_lanes;
+        std::vector<Scalar*> amount_lanes, retirement_lanes;
+        std::vector<uint8_t*> bankrupt_lanes;
+        if (kernel_) {
+            for (size_t m = 0; m < markets_.size(); ++m) {
+                now_lanes.push_back(now[m].data());
+                ahead_lanes.push_back(ahead[m].data());
+            }
+            for (size_t s = 0; s < schedules_.size(); ++s) {
+                for (auto& amount : amounts[s]) {
+                    amount_lanes.push_back(amount.data());
+                }
+                retirement_lanes.push_back(retirements[s].data());
+                bankrupt_lanes.push_back(bankrupts[s].data());
+            }
+            args = {
+                .schedules = schedules_.data(),
+                .now = now_lanes.data(),
+                .ahead = ahead_lanes.data(),
+                .amounts = amount_lanes.data(),
+                .retirements = retirement_lanes.data(),
+                .bankrupts = bankrupt_lanes.data()
+            };
+        }
+
+        for (size_t i = 0; i < steps.steps(); ++i) {
+            for (size_t m = 0; m < markets_.size(); ++m) {
+                lookup(*markets_[m], i, now[m], ahead[m]);
+
+                // Padding lanes in a partial block, these just need to stay finite.
+                for (size_t l = count; l < LANES; ++l) {
+                    now[m][l] = ahead[m][l] = 1.0;
+                }
+            }
+
+            if (kernel_) {
+                args.step = i;
+                kernel_(args);
+            } else {
+                for (size_t s = 0; s < schedules_.size(); ++s) {
+                    step(s, i, now, ahead, amounts[s], retirements[s], bankrupts[s], spend, taxes[s], policies[s]);
+                }
+            }
+            observe(i, amounts, bankrupts);
+        }
+
+        for (size_t s = 0; s < schedules_.size(); ++s) {
+            for (size_t l = 0; l < count; ++l) {
+                Scalar total = 0;
+                for (const auto& amount : amounts[s]) { total += amount[l]; }
+
+                // Less the last tax year's tax, which hasn't been paid yet.
+                if (schedules_[s]->taxes) {
+                    total -= Money<Scalar>::from_dollars(taxes[s].due[l]);
+                }
+
+                results[s].final[first + l] = total;
+                results[s].retirement[first + l] = retirements[s][l];
+                results[s].bankrupt[first + l] = bankrupts[s][l];
+            }
+        }
+    }
+
+    void step(size_t s,
+              size_t i,
+              const std::vector<Prices>& now,
+              const std::vector<Prices>& ahead,
+              std::vector<Lanes>& amounts,
+              Lanes& retirement,
+              std::array<uint8_t, LANES>& bankrupt,
+              Lanes& spend,
+              TaxLanes& tax,
+              PolicyLanes& policy) const {
+        const Schedule& schedule = *schedules_[s];
+        const auto& funds = schedule.funds;
+        const bool taxed = schedule.taxes.has_value();
+
+        if (schedule.retirement_step == i) {
+            retirement.fill(0);
+            for (const auto& amount : amounts) {
+                for (size_t l = 0; l < LANES; ++l) { retirement[l] += amount[l]; }
+            }
+        }
+
+        for (size_t f = 0; f < funds.size(); ++f) {
+            const BatchFund& fund = funds[f];
+            Lanes& amount = amounts[f];
+
+            if (fund.market) {
+                const size_t m = fund_markets_[s][f];
+                const Prices& fund_now = now[m];
+                const Prices& fund_ahead = ahead[m];
+                for (size_t l = 0; l < LANES; ++l) { amount[l] = Money<Scalar>::grow(amount[l], fund_ahead[l], fund_now[l]); }
+            } else {
+                const double growth = fund.growth[i];
+                for (size_t l = 0; l < LANES; ++l) { amount[l] = Money<Scalar>::grow(amount[l], growth); }
+            }
+
+            const Scalar contributed = Money<Scalar>::from_dollars(fund.contributed[i]);
+            for (size_t l = 0; l < LANES; ++l) { amount[l] += contributed; }
+            if (taxed && fund.account == Account::TAXABLE) {
+                for (size_t l = 0; l < LANES; ++l) { tax.basis[f][l] += contributed; }
+            }
+        }
+
+        spend.fill(Money<Scalar>::from_dollars(schedule.to_spend[i]));
+        if (!schedule.policy.fixed()) {
+            apply_policy(schedule, i, amounts, spend, policy);
+        }
+        if (taxed) {
+            sell_taxed(schedule, i, sell_orders_[s], amounts, spend, tax);
+            for (size_t l = 0; l < LANES; ++l) { bankrupt[l] |= spend[l] > 0; }
+            return;
+        }
+
+        for (size_t f : sell_orders_[s]) {
+            if (schedule.years[i] < funds[f].start) {
+                continue;
+            }
+
+            Lanes& amount = amounts[f];
+            for (size_t l = 0; l < LANES; ++l) {
+                const Scalar sold = amount[l] >= spend[l] ? spend[l] : amount[l];
+                amount[l] -= sold;
+                spend[l] -= sold;
+            }
+        }
+
+        for (size_t l = 0; l < LANES; ++l) { bankrupt[l] |= spend[l] > 0; }
+    }
+
+    //
+    // Changes what's withdrawn to follow the schedule's spending policy (see Policy). At the start of each year the
+    // portfolio is totalled on every lane, which PERCENT sets the year's budget from and GUARDRAIL compares the last
+    // year's spending to. From retirement on, each lane's spending then replaces what was planned in the withdrawal.
+    // All of it is plain loops over the lanes, in dollars whatever the balances are in.
+    //
+    void apply_policy(const Schedule& schedule,
+                      size_t i,
+                      const std::vector<Lanes>& amounts,
+                      Lanes& spend,
+                      PolicyLanes& state) const {
+        const Policy& policy = schedule.policy;
+        const bool guardrail = policy.spending == Policy::Spending::GUARDRAIL;
+
+        if (schedule.new_year[i]) {
+            state.total.fill(0);
+            for (const auto& amount : amounts) {
+                for (size_t l = 0; l < LANES; ++l) { state.total[l] += Money<Scalar>::to_dollars(amount[l]); }
+            }
+
+            if (guardrail) {
+                for (size_t l = 0; l < LANES; ++l) {
+                    state.scale[l] *= policy.guardrail(state.withdrawn[l], state.total[l]);
+                }
+            } else {
+                for (size_t l = 0; l < LANES; ++l) { state.budget[l] = policy.rate * state.total[l]; }
+            }
+            state.withdrawn.fill(0);
+        }
+
+        if (!schedule.retirement_step || i < *schedule.retirement_step) {
+            return;
+        }
+
+        const double planned = schedule.spending[i];
+        const double to_spend = schedule.to_spend[i];
+        if (guardrail) {
+            for (size_t l = 0; l < LANES; ++l) { state.spent[l] = planned * state.scale[l]; }
+        } else {
+            const double dt = schedule.years[i] - (i > 0 ? schedule.years[i - 1] : 0.0);
+            for (size_t l = 0; l < LANES; ++l) { state.spent[l] = policy.percent(state.budget[l], dt, planned); }
+        }
+        for (size_t l = 0; l < LANES; ++l) {
+            spend[l] = Money<Scalar>::from_dollars(Policy::withdrawal(to_spend, planned, state.spent[l]));
+            state.withdrawn[l] += state.spent[l];
+        }
+    }
+
+    //
+    // Sells like step() does, but also pays the last tax year's tax and adds up what this step's withdrawals will owe:
+    // all of a pre-tax withdrawal is income, while selling from a taxable fund realizes the gain over its average cost.
+    // On the last step of each tax year the tax on the year's withdrawals is worked out on every lane at once (see
+    // TaxTable) with them stacked on top of the salary, which is due on the next step. Only settling once a year
+    // keeps the bracket tables off every other step.
+    //
+    void sell_taxed(const Schedule& schedule,
+                    size_t i,
+                    const std::vector<size_t>& order,
+                    std::vector<Lanes>& amounts,
+                    Lanes& spend,
+                    TaxLanes& tax) const {
+        const auto& funds = schedule.funds;
+        // Nothing is ever sold for a negative spend (which would put it into the fund instead), whatever the other
+        // lanes are doing.
+        bool selling = false;
+        for (size_t l = 0; l < LANES; ++l) {
+            spend[l] = std::max<Scalar>(spend[l] + Money<Scalar>::from_dollars(tax.due[l]), 0);
+            selling |= spend[l] > 0;
+        }
+        tax.due.fill(0);
+
+        for (size_t f : order) {
+            if (!selling || schedule.years[i] < funds[f].start) {
+                continue;
+            }
+
+            Lanes& amount = amounts[f];
+            Lanes& basis = tax.basis[f];
+            switch (funds[f].account) {
+            case Account::TAXABLE:
+                for (size_t l = 0; l < LANES; ++l) {
+                    const Scalar sold = amount[l] >= spend[l] ? spend[l] : amount[l];
+                    const Scalar cost = cost_basis(sold, basis[l], amount[l]);
+                    basis[l] -= cost;
+                    tax.gains[l] += Money<Scalar>::to_dollars(sold - cost);
+                    amount[l] -= sold;
+                    spend[l] -= sold;
+                }
+                break;
+            case Account::PRETAX:
+                for (size_t l = 0; l < LANES; ++l) {
+                    const Scalar sold = amount[l] >= spend[l] ? spend[l] : amount[l];
+                    tax.ordinary[l] += Money<Scalar>::to_dollars(sold);
+                    amount[l] -= sold;
+                    spend[l] -= sold;
+                }
+                break;
+            case Account::ROTH:
+                for (size_t l = 0; l < LANES; ++l) {
+                    const Scalar sold = amount[l] >= spend[l] ? spend[l] : amount[l];
+                    amount[l] -= sold;
+                    spend[l] -= sold;
+                }
+                break;
+            }
+        }
+
+        if (i + 1 < schedule.steps() && !schedule.new_year[i + 1]) {
+            return;
+        }
+
+        // Nothing withdrawn this year (as while working) means nothing more to pay.
+        bool withdrawn = false;
+        for (size_t l = 0; l < LANES; ++l) { withdrawn |= (tax.ordinary[l] != 0) | (tax.gains[l] != 0); }
+        if (!withdrawn) {
+            return;
+        }
+
+        // The salary's tax is already paid, the rest is due next step. A loss offsetting the salary could take that
+        // below what was paid on it, which isn't refunded.
+        const double salary = schedule.taxed_income[i];
+        for (size_t l = 0; l < LANES; ++l) { tax.income[l] = salary + tax.ordinary[l]; }
+        Taxes::net_losses(tax.income, tax.gains, tax.carried);
+        tax.tax.fill(-schedule.taxes->income(salary));
+        schedule.taxes->accumulate(tax.income, tax.gains, tax.total, tax.tax);
+        for (size_t l = 0; l < LANES; ++l) { tax.due[l] = std::max(tax.tax[l], 0.0); }
+        tax.ordinary.fill(0);
+        tax.gains.fill(0);
+    }
+
+    //
+    // Share of the basis sold along with part of a fund (at the average cost). An empty fund sells nothing, so
+    // dividing by 1 rather than 0 there keeps this free of branches.
+    //
+    static Scalar cost_basis(Scalar sold, Scalar basis, Scalar amount) {
+        if constexpr (std::is_integral_v<Scalar>) {
+            return std::llround(static_cast<double>(sold) * basis / (amount + (amount == 0)));
+        } else {
+            return sold * (basis / (amount + (amount == 0)));
+        }
+    }
+
+private:
+    std::vector<const Schedule*> schedules_;
+
+    // Every distinct market read by the schedules, looked up once per step, and the index of each fund's market.
+    std::vector<const MarketData*> markets_;
+    std::vector<std::vector<size_t>> fund_markets_;
+
+    // The order each schedule's funds are sold in.
+    std::vector<std::vector<size_t>> sell_orders_;
+
+    Kernel kernel_ = nullptr;
+};
@@ -0,0 +1,405 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//
+// Results stored a column at a time in blocks of BLOCK_ROWS rows, with the min and max of every column in every block
+// (a zone map). A query only reads the columns it needs, and skips whole blocks whose zones can't match (or doesn't
+// bother checking a column in blocks whose zones always match).
+//
+//   Header, column names, (padding), block 0 column 0, block 0 column 1, ..., block 1 column 0, ..., zones
+//
+// Every block is stored full size (the last is padded) so the data for any block and column is at a fixed offset.
+// Everything is stored in native byte order.
+//
+namespace column_store {
+
+constexpr uint32_t MAGIC = 0x5343534c;  // "LSCS"
+constexpr size_t BLOCK_ROWS = 1 << 16;
+
+struct Header {
+    uint32_t magic = MAGIC;
+    uint32_t columns = 0;
+    uint64_t rows = 0;
+    uint64_t block_rows = BLOCK_ROWS;
+    uint64_t data_offset = 0;
+    uint64_t zones_offset = 0;
+};
+
+// NaN (like the retirement value of a simulation that never retired) is left out of the min and max, but counted.
+struct Zone {
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    uint64_t nans = 0;
+};
+
+}  // namespace column_store
+
+//
+// Writes rows (in order) to a column store, a block at a time.
+//
+class ColumnStoreWriter {
+public:
+    ColumnStoreWriter(const std::string& path, std::vector<std::string> columns)
+        : file_(path, std::ios::binary | std::ios::trunc), columns_(std::move(columns)) {
+        if (!file_) {
+            throw std::runtime_error("Unable to open " + path);
+        }
+
+        header_.columns = columns_.size();
+        std::string names;
+        for (const auto& column : columns_) {
+            const uint32_t length = column.size();
+            names.append(reinterpret_cast<const char*>(&length), sizeof(length));
+            names += column;
+        }
+
+        // Keep the columns aligned for the scans.
+        header_.data_offset = (sizeof(header_) + names.size() + 63) / 64 * 64;
+        write(&header_, sizeof(header_));
+        write(names.data(), names.size());
+        file_.seekp(header_.data_offset);
+
+        block_.resize(columns_.size() * column_store::BLOCK_ROWS);
+    }
+    ~ColumnStoreWriter() { close(); }
+
+public:
+    size_t columns() const { return columns_.size(); }
+
+    // Appends a row, with a value for every column.
+    void append(const double* row) {
+        const size_t i = header_.rows % column_store::BLOCK_ROWS;
+        for (size_t c = 0; c < columns_.size(); ++c) {
+            block_[c * column_store::BLOCK_ROWS + i] = row[c];
+        }
+        header_.rows++;
+
+        if (i + 1 == column_store::BLOCK_ROWS) {
+            flush(column_store::BLOCK_ROWS);
+        }
+    }
+
+    // Writes the last block, the zones and the header. Nothing can be appended after.
+    void close() {
+        if (!file_.is_open()) {
+            return;
+        }
+
+        if (const size_t partial = header_.rows % column_store::BLOCK_ROWS) {
+            for (size_t c = 0; c < columns_.size(); ++c) {
+                std::fill(block_.begin() + c * column_store::BLOCK_ROWS + partial,
+                          block_.begin() + (c + 1) * column_store::BLOCK_ROWS,
+                          0.0);
+            }
+            flush(partial);
+        }
+
+        header_.zones_offset = file_.tellp();
+        write(zones_.data(), zones_.size() * sizeof(column_store::Zone));
+        file_.seekp(0);
+        write(&header_, sizeof(header_));
+        file_.close();
+    }
+
+private:
+    void flush(size_t rows) {
+        for (size_t c = 0; c < columns_.size(); ++c) {
+            const double* values = block_.data() + c * column_store::BLOCK_ROWS;
+            column_store::Zone& zone = zones_.emplace_back();
+            for (size_t i = 0; i < rows; ++i) {
+                zone.min = std::min(zone.min, values[i]);
+                zone.max = std::max(zone.max, values[i]);
+                zone.nans += std::isnan(values[i]);
+            }
+        }
+        write(block_.data(), block_.size() * sizeof(double));
+    }
+
+    void write(const void* data, size_t size) {
+        if (!file_.write(static_cast<const char*>(data), size)) {
+            throw std::runtime_error("Failed to write the column store.");
+        }
+    }
+
+private:
+    std::ofstream file_;
+    std::vector<std::string> columns_;
+
+    column_store::Header header_;
+    std::vector<double> block_;
+    std::vector<column_store::Zone> zones_;
+};
+
+//
+// A filter on a single column, like "job-duration > 8".
+//
+struct Predicate {
+    enum class Op { LESS, LESS_EQUAL, GREATER, GREATER_EQUAL, EQUAL, NOT_EQUAL };
+
+    size_t column = 0;
+    Op op = Op::EQUAL;
+    double value = 0.0;
+
+    // Whether any (or every) value within the zone can pass.
+    bool any(const column_store::Zone& zone) const {
+        switch (op) {
+        case Op::LESS: return zone.min < value;
+        case Op::LESS_EQUAL: return zone.min <= value;
+        case Op::GREATER: return zone.max > value;
+        case Op::GREATER_EQUAL: return zone.max >= value;
+        case Op::EQUAL: return zone.min <= value && value <= zone.max;
+        case Op::NOT_EQUAL: return !(zone.min == value && zone.max == value);
+        }
+        return true;
+    }
+    bool all(const column_store::Zone& zone) const {
+        if (zone.nans > 0) {
+            return false;
+        }
+        switch (op) {
+        case Op::LESS: return zone.max < value;
+        case Op::LESS_EQUAL: return zone.max <= value;
+        case Op::GREATER: return zone.min > value;
+        case Op::GREATER_EQUAL: return zone.min >= value;
+        case Op::EQUAL: return zone.min == value && zone.max == value;
+        case Op::NOT_EQUAL: return value < zone.min || zone.max < value;
+        }
+        return false;
+    }
+
+    //
+    // Clears the mask for every value that doesn't pass. Each comparison is its own loop without branches, so the
+    // compiler turns them into vector compares.
+    //
+    void apply(const double* values, size_t count, uint8_t* mask) const {
+        const double v = value;
+        switch (op) {
+        case Op::LESS: for (size_t i = 0; i < count; ++i) mask[i] &= values[i] < v; return;
+        case Op::LESS_EQUAL: for (size_t i = 0; i < count; ++i) mask[i] &= values[i] <= v; return;
+        case Op::GREATER: for (size_t i = 0; i < count; ++i) mask[i] &= values[i] > v; return;
+        case Op::GREATER_EQUAL: for (size_t i = 0; i < count; ++i) mask[i] &= values[i] >= v; return;
+        case Op::EQUAL: for (size_t i = 0; i < count; ++i) mask[i] &= values[i] == v; return;
+        case Op::NOT_EQUAL: for (size_t i = 0; i < count; ++i) mask[i] &= values[i] != v; return;
+        }
+    }
+};
+
+struct QueryResult {
+    size_t rows = 0;
+    size_t bankrupt = 0;
+
+    // Of the aggregated column, over the matching rows where it isn't NaN.
+    size_t values = 0;
+    double sum = 0.0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+
+    // How many blocks were skipped by their zones, and how many were read.
+    size_t blocks_skipped = 0;
+    size_t blocks_scanned = 0;
+};
+
+//
+// Memory maps a column store for querying, so only the blocks of the columns a query touches are read from disk.
+//
+class ColumnStore {
+public:
+    explicit ColumnStore(const std::string& path) {
+        fd_ = open(path.c_str(), O_RDONLY);
+        if (fd_ == -1) {
+            throw std::runtime_error("Failed to open " + path);
+        }
+
+        struct stat file_stat;
+        if (fstat(fd_, &file_stat) == -1) {
+            throw std::runtime_error("Failed to get file stat");
+        }
+        size_ = file_stat.st_size;
+        if (size_ < sizeof(column_store::Header)) {
+            throw std::runtime_error(path + " isn't a column store.");
+        }
+
+        void* map = mmap(0, size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (map == MAP_FAILED) {
+            throw std::runtime_error("Failed to map file");
+        }
+        data_ = static_cast<const char*>(map);
+
+        std::memcpy(&header_, data_, sizeof(header_));
+        blocks_ = (header_.rows + header_.block_rows - 1) / header_.block_rows;
+        if (header_.magic != column_store::MAGIC ||
+            header_.zones_offset != header_.data_offset + blocks_ * header_.columns * header_.block_rows * sizeof(double) ||
+            header_.zones_offset + blocks_ * header_.columns * sizeof(column_store::Zone) != size_) {
+            throw std::runtime_error(path + " isn't a complete column store.");
+        }
+
+        const char* name = data_ + sizeof(header_);
+        for (size_t c = 0; c < header_.columns; ++c) {
+            uint32_t length;
+            std::memcpy(&length, name, sizeof(length));
+            columns_.emplace_back(name + sizeof(length), length);
+            name += sizeof(length) + length;
+        }
+    }
+
+    ~ColumnStore() {
+        if (data_) munmap(const_cast<char*>(data_), size_);
+        if (fd_ != -1) close(fd_);
+    }
+
+    ColumnStore(const ColumnStore&) = delete;
+    ColumnStore& operator=(const ColumnStore&) = delete;
+
+public:
+    size_t rows() const { return header_.rows; }
+    const std::vector<std::string>& columns() const { return columns_; }
+
+    size_t column(const std::string& name) const {
+        auto it = std::find(columns_.begin(), columns_.end(), name);
+        if (it == columns_.end()) {
+            throw std::runtime_error("No column named '" + name + "'");
+        }
+        return it - columns_.begin();
+    }
+
+    //
+    // Parses a filter like "job-duration > 8 and spending-rate < 50" (an empty filter matches everything).
+    //
+    std::vector<Predicate> parse(const std::string& filter) const {
+        static const std::vector<std::pair<std::string, Predicate::Op>> OPS = {
+            {"<", Predicate::Op::LESS}, {"<=", Predicate::Op::LESS_EQUAL},
+            {">", Predicate::Op::GREATER}, {">=", Predicate::Op::GREATER_EQUAL},
+            {"==", Predicate::Op::EQUAL}, {"=", Predicate::Op::EQUAL}, {"!=", Predicate::Op::NOT_EQUAL},
+        };
+
+        std::vector<Predicate> predicates;
+        std::stringstream ss(filter);
+        for (std::string name, op, value; ss >> name;) {
+            if (!predicates.empty()) {
+                if (name != "and") {
+                    throw std::runtime_error("Expected 'and' between filters, got '" + name + "'");
+                }
+                ss >> name;
+            }
+            if (!(ss >> op >> value)) {
+                throw std::runtime_error("Filters look like 'column > value', got '" + name + "'");
+            }
+
+            Predicate& predicate = predicates.emplace_back();
+            predicate.column = column(name);
+            auto it = std::find_if(OPS.begin(), OPS.end(), [&](const auto& entry) { return entry.first == op; });
+            if (it == OPS.end()) {
+                throw std::runtime_error("Unknown comparison '" + op + "'");
+            }
+            predicate.op = it->second;
+            try {
+                predicate.value = std::stod(value);
+            } catch (const std::exception&) {
+                throw std::runtime_error("Expected a number to compare against, got '" + value + "'");
+            }
+        }
+        return predicates;
+    }
+
+    //
+    // Aggregates the column (and the bankrupt column) over rows passing every predicate.
+    //
+    QueryResult query(const std::vector<Predicate>& predicates, size_t aggregate, size_t bankrupt) const {
+        QueryResult result;
+        std::vector<uint8_t> mask(header_.block_rows);
+        for (size_t b = 0; b < blocks_; ++b) {
+            const size_t count = std::min<size_t>(header_.block_rows, header_.rows - b * header_.block_rows);
+
+            bool skip = false;
+            bool every = true;
+            for (const auto& predicate : predicates) {
+                skip |= !predicate.any(zone(b, predicate.column));
+                every &= predicate.all(zone(b, predicate.column));
+            }
+            if (skip) {
+                result.blocks_skipped++;
+                continue;
+            }
+            result.blocks_scanned++;
+
+            const double* values = column_data(b, aggregate);
+            const double* bankrupts = column_data(b, bankrupt);
+            if (every) {
+                // Every row passes, the zone already has the min and max.
+                const column_store::Zone& aggregate_zone = zone(b, aggregate);
+                result.min = std::min(result.min, aggregate_zone.min);
+                result.max = std::max(result.max, aggregate_zone.max);
+                result.rows += count;
+                result.values += count - aggregate_zone.nans;
+                for (size_t i = 0; i < count; ++i) {
+                    result.sum += values[i] == values[i] ? values[i] : 0.0;
+                    result.bankrupt += bankrupts[i] != 0.0;
+                }
+                continue;
+            }
+
+            std::fill(mask.begin(), mask.begin() + count, 1);
+            for (const auto& predicate : predicates) {
+                if (!predicate.all(zone(b, predicate.column))) {
+                    predicate.apply(column_data(b, predicate.column), count, mask.data());
+                }
+            }
+
+            size_t rows = 0;
+            size_t bankrupt_rows = 0;
+            for (size_t i = 0; i < count; ++i) {
+                rows += mask[i];
+                bankrupt_rows += mask[i] & (bankrupts[i] != 0.0);
+            }
+            result.rows += rows;
+            result.bankrupt += bankrupt_rows;
+            if (rows == 0) {
+                continue;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                // Comparisons with NaN are false, so NaN never makes it past the mask.
+                const bool use = mask[i] && values[i] == values[i];
+                result.values += use;
+                result.sum += use ? values[i] : 0.0;
+                result.min = std::min(result.min, use ? values[i] : result.min);
+                result.max = std::max(result.max, use ? values[i] : result.max);
+            }
+        }
+        return result;
+    }
+
+private:
+    const column_store::Zone& zone(size_t block, size_t column) const {
+        const auto* zones = reinterpret_cast<const column_store::Zone*>(data_ + header_.zones_offset);
+        return zones[block * header_.columns + column];
+    }
+
+    const double* column_data(size_t block, size_t column) const {
+        const size_t offset = header_.data_offset + (block * header_.columns + column) * header_.block_rows * sizeof(double);
+        return reinterpret_cast<const double*>(data_ + offset);
+    }
+
+private:
+    int fd_ = -1;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+
+    column_store::Header header_;
+    size_t blocks_ = 0;
+    std::vector<std::string> columns_;
+};
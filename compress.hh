@@ -0,0 +1,374 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+
+//
+// Output compressed as a sequence of independent frames, each of which can be decompressed on its own, so frames can
+// be compressed in parallel by whichever thread produced them and a reader can start at any frame. The frames are
+// followed by an index of where each one starts and the first simulation id in it, and a fixed size footer pointing
+// at the index:
+//
+//   FrameHeader, payload, FrameHeader, payload, ..., FrameHeader (INDEX_MAGIC), IndexEntry..., Footer
+//
+// Everything is stored in native byte order.
+//
+enum class Codec : uint8_t {
+    NONE = 0,
+    LZ = 1,
+    ZSTD = 2,
+};
+
+// Large enough for the codecs to find plenty of repetition, small enough to seek to a simulation quickly.
+constexpr size_t FRAME_BYTES = 1 << 16;
+
+constexpr uint32_t FRAME_MAGIC = 0x3146534c;  // "LSF1"
+constexpr uint32_t INDEX_MAGIC = 0x5849534c;  // "LSIX"
+
+struct FrameHeader {
+    uint32_t magic = FRAME_MAGIC;
+    uint8_t codec = 0;
+    uint8_t padding[3] = {};
+
+    // Size of the frame decompressed, and of the payload following this header.
+    uint32_t raw_size = 0;
+    uint32_t size = 0;
+
+    // First simulation id in the frame (or for the index, the number of entries).
+    uint64_t first_id = 0;
+};
+
+struct IndexEntry {
+    uint64_t first_id = 0;
+    uint64_t offset = 0;
+    uint32_t raw_size = 0;
+    uint32_t size = 0;
+};
+
+struct Footer {
+    uint64_t index_offset = 0;
+    uint32_t magic = INDEX_MAGIC;
+    uint32_t padding = 0;
+};
+
+//
+// A small LZ77 codec in the spirit of LZ4, used when zstd isn't installed. Each sequence is a token (literal length
+// in the high nibble, match length - 4 in the low nibble, 15 meaning more length bytes follow), the literals, then a
+// 16 bit offset back to the match. The last sequence is only literals.
+//
+namespace lz {
+
+constexpr size_t MIN_MATCH = 4;
+constexpr size_t HASH_BITS = 14;
+constexpr size_t MAX_OFFSET = 0xffff;
+
+// Matches need this many literal bytes after them, so the final sequence always has some and the compressor can
+// always read a whole word.
+constexpr size_t END_LITERALS = 8;
+
+inline uint32_t read32(const char* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline void write_length(size_t length, std::string& out) {
+    for (; length >= 255; length -= 255) {
+        out += static_cast<char>(255);
+    }
+    out += static_cast<char>(length);
+}
+
+inline void write_sequence(const char* literals, size_t literal_length, size_t offset, size_t match_length, std::string& out) {
+    const size_t match_code = match_length >= MIN_MATCH ? match_length - MIN_MATCH : 0;
+    out += static_cast<char>((std::min<size_t>(literal_length, 15) << 4) | std::min<size_t>(match_code, 15));
+    if (literal_length >= 15) {
+        write_length(literal_length - 15, out);
+    }
+    out.append(literals, literal_length);
+    if (match_length == 0) {
+        return;
+    }
+    out += static_cast<char>(offset & 0xff);
+    out += static_cast<char>(offset >> 8);
+    if (match_code >= 15) {
+        write_length(match_code - 15, out);
+    }
+}
+
+// Appends the compressed data to out.
+inline void compress(const char* data, size_t size, std::string& out) {
+    std::vector<uint32_t> table(1 << HASH_BITS, 0);
+    auto hash = [](uint32_t value) { return (value * 2654435761u) >> (32 - HASH_BITS); };
+
+    size_t anchor = 0;
+    size_t i = 0;
+    const size_t limit = size > END_LITERALS + MIN_MATCH ? size - END_LITERALS - MIN_MATCH : 0;
+    while (i < limit) {
+        const uint32_t value = read32(data + i);
+        uint32_t& entry = table[hash(value)];
+        const size_t candidate = entry;
+        entry = i;
+
+        if (candidate >= i || i - candidate > MAX_OFFSET || read32(data + candidate) != value) {
+            ++i;
+            continue;
+        }
+
+        size_t length = MIN_MATCH;
+        while (i + length < size - END_LITERALS && data[candidate + length] == data[i + length]) {
+            ++length;
+        }
+
+        write_sequence(data + anchor, i - anchor, i - candidate, length, out);
+        i += length;
+        anchor = i;
+    }
+    write_sequence(data + anchor, size - anchor, 0, 0, out);
+}
+
+// Appends the decompressed data (which must come to raw_size bytes) to out.
+inline void decompress(const char* data, size_t size, size_t raw_size, std::string& out) {
+    const char* end = data + size;
+    auto read_length = [&](size_t length) {
+        if (length < 15) {
+            return length;
+        }
+        while (true) {
+            if (data >= end) {
+                throw std::runtime_error("Truncated compressed frame.");
+            }
+            const uint8_t extra = *data++;
+            length += extra;
+            if (extra != 255) {
+                return length;
+            }
+        }
+    };
+
+    const size_t start = out.size();
+    out.resize(start + raw_size);
+    char* const first = out.data() + start;
+    char* const last = first + raw_size;
+    char* dest = first;
+    while (data < end) {
+        const uint8_t token = *data++;
+        const size_t literal_length = read_length(token >> 4);
+        if (literal_length > static_cast<size_t>(end - data) || literal_length > static_cast<size_t>(last - dest)) {
+            throw std::runtime_error("Corrupt compressed frame.");
+        }
+        std::memcpy(dest, data, literal_length);
+        dest += literal_length;
+        data += literal_length;
+        if (data == end) {
+            break;
+        }
+
+        if (end - data < 2) {
+            throw std::runtime_error("Truncated compressed frame.");
+        }
+        const size_t offset = static_cast<uint8_t>(data[0]) | (static_cast<uint8_t>(data[1]) << 8);
+        data += 2;
+        const size_t match_length = read_length(token & 0xf) + MIN_MATCH;
+        if (offset == 0 || offset > static_cast<size_t>(dest - first) || match_length > static_cast<size_t>(last - dest)) {
+            throw std::runtime_error("Corrupt compressed frame.");
+        }
+
+        // Matches can overlap what they're copying (a run of zeros is a match one zero back), so copy forwards.
+        const char* from = dest - offset;
+        for (size_t j = 0; j < match_length; ++j) {
+            dest[j] = from[j];
+        }
+        dest += match_length;
+    }
+
+    if (dest != last) {
+        throw std::runtime_error("Corrupt compressed frame.");
+    }
+}
+
+}  // namespace lz
+
+//
+// libzstd, loaded at run time if it's installed so it isn't needed to build or run.
+//
+class Zstd {
+public:
+    static const Zstd* get() {
+        static const Zstd zstd;
+        return zstd.available() ? &zstd : nullptr;
+    }
+
+    bool available() const { return compress_ && decompress_ && bound_ && is_error_; }
+
+    void compress(const char* data, size_t size, std::string& out) const {
+        const size_t start = out.size();
+        out.resize(start + bound_(size));
+        const size_t written = compress_(out.data() + start, out.size() - start, data, size, LEVEL);
+        if (is_error_(written)) {
+            throw std::runtime_error("zstd failed to compress a frame.");
+        }
+        out.resize(start + written);
+    }
+
+    void decompress(const char* data, size_t size, size_t raw_size, std::string& out) const {
+        const size_t start = out.size();
+        out.resize(start + raw_size);
+        const size_t written = decompress_(out.data() + start, raw_size, data, size);
+        if (is_error_(written) || written != raw_size) {
+            throw std::runtime_error("Corrupt zstd frame.");
+        }
+    }
+
+private:
+    // Fast, still a few times smaller than the LZ codec on traces.
+    static constexpr int LEVEL = 3;
+
+    Zstd() {
+        handle_ = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+        if (!handle_) {
+            return;
+        }
+        compress_ = reinterpret_cast<decltype(compress_)>(dlsym(handle_, "ZSTD_compress"));
+        decompress_ = reinterpret_cast<decltype(decompress_)>(dlsym(handle_, "ZSTD_decompress"));
+        bound_ = reinterpret_cast<decltype(bound_)>(dlsym(handle_, "ZSTD_compressBound"));
+        is_error_ = reinterpret_cast<decltype(is_error_)>(dlsym(handle_, "ZSTD_isError"));
+    }
+    ~Zstd() {
+        if (handle_) dlclose(handle_);
+    }
+
+    void* handle_ = nullptr;
+    size_t (*compress_)(void*, size_t, const void*, size_t, int) = nullptr;
+    size_t (*decompress_)(void*, size_t, const void*, size_t) = nullptr;
+    size_t (*bound_)(size_t) = nullptr;
+    unsigned (*is_error_)(size_t) = nullptr;
+};
+
+// Parses "lz", "zstd" or "auto" (zstd if it's installed, otherwise lz).
+inline Codec parse_codec(const std::string& name) {
+    if (name == "lz") {
+        return Codec::LZ;
+    } else if (name == "zstd") {
+        if (!Zstd::get()) {
+            throw std::runtime_error("zstd compression needs libzstd.so.1 to be installed.");
+        }
+        return Codec::ZSTD;
+    } else if (name == "auto") {
+        return Zstd::get() ? Codec::ZSTD : Codec::LZ;
+    }
+    throw std::runtime_error("Unknown compression '" + name + "' (expected lz, zstd or auto).");
+}
+
+// Appends a whole frame (header and payload) holding the data to out.
+inline void compress_frame(Codec codec, uint64_t first_id, const std::string& data, std::string& out) {
+    const size_t start = out.size();
+    out.resize(start + sizeof(FrameHeader));
+    if (codec == Codec::ZSTD) {
+        Zstd::get()->compress(data.data(), data.size(), out);
+    } else {
+        lz::compress(data.data(), data.size(), out);
+    }
+
+    FrameHeader header;
+    header.codec = static_cast<uint8_t>(codec);
+    header.raw_size = data.size();
+    header.size = out.size() - start - sizeof(FrameHeader);
+    header.first_id = first_id;
+    std::memcpy(out.data() + start, &header, sizeof(header));
+}
+
+inline void decompress_payload(const FrameHeader& header, const char* payload, std::string& out) {
+    switch (static_cast<Codec>(header.codec)) {
+    case Codec::NONE:
+        out.append(payload, header.size);
+        return;
+    case Codec::LZ:
+        lz::decompress(payload, header.size, header.raw_size, out);
+        return;
+    case Codec::ZSTD:
+        if (!Zstd::get()) {
+            throw std::runtime_error("Reading zstd frames needs libzstd.so.1 to be installed.");
+        }
+        Zstd::get()->decompress(payload, header.size, header.raw_size, out);
+        return;
+    }
+    throw std::runtime_error("Unknown frame codec.");
+}
+
+//
+// Reads output written with compressed frames. The index is read up front, so any frame can be decompressed without
+// touching the ones before it.
+//
+class FrameReader {
+public:
+    explicit FrameReader(const std::string& path) : file_(path, std::ios::binary) {
+        if (!file_) {
+            throw std::runtime_error("Unable to open '" + path + "'");
+        }
+
+        file_.seekg(0, std::ios::end);
+        const uint64_t file_size = file_.tellg();
+        Footer footer;
+        if (file_size < sizeof(footer) + sizeof(FrameHeader)) {
+            throw std::runtime_error("'" + path + "' is too small to hold compressed output.");
+        }
+        read_at(file_size - sizeof(footer), &footer, sizeof(footer));
+
+        FrameHeader header;
+        if (footer.magic == INDEX_MAGIC && footer.index_offset + sizeof(header) <= file_size - sizeof(footer)) {
+            read_at(footer.index_offset, &header, sizeof(header));
+        }
+        if (footer.magic != INDEX_MAGIC || header.magic != INDEX_MAGIC ||
+            footer.index_offset + sizeof(header) + header.first_id * sizeof(IndexEntry) != file_size - sizeof(footer)) {
+            throw std::runtime_error("'" + path + "' doesn't end with a frame index, was it written completely?");
+        }
+
+        index_.resize(header.first_id);
+        read_at(footer.index_offset + sizeof(header), index_.data(), index_.size() * sizeof(IndexEntry));
+    }
+
+public:
+    const std::vector<IndexEntry>& index() const { return index_; }
+
+    // The last frame starting at or before the simulation id. Frame 0 is always the header row.
+    size_t find(uint64_t id) const {
+        auto it = std::upper_bound(index_.begin() + std::min<size_t>(index_.size(), 1), index_.end(), id,
+                                   [](uint64_t id, const IndexEntry& entry) { return id < entry.first_id; });
+        return std::max<size_t>(it - index_.begin(), 2) - 1;
+    }
+
+    // Appends the decompressed frame to out.
+    void read(size_t frame, std::string& out) {
+        const IndexEntry& entry = index_.at(frame);
+        FrameHeader header;
+        read_at(entry.offset, &header, sizeof(header));
+        if (header.magic != FRAME_MAGIC || header.size != entry.size || header.raw_size != entry.raw_size) {
+            throw std::runtime_error("Frame " + std::to_string(frame) + " doesn't match the index.");
+        }
+
+        payload_.resize(header.size);
+        read_at(entry.offset + sizeof(header), payload_.data(), payload_.size());
+        decompress_payload(header, payload_.data(), out);
+    }
+
+private:
+    void read_at(uint64_t offset, void* data, size_t size) {
+        file_.seekg(offset);
+        if (!file_.read(static_cast<char*>(data), size)) {
+            throw std::runtime_error("Unexpected end of the compressed output.");
+        }
+    }
+
+private:
+    std::ifstream file_;
+    std::vector<IndexEntry> index_;
+    std::string payload_;
+};
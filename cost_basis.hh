@@ -0,0 +1,142 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+// How the cost of what's sold from a fund is worked out.
+enum class BasisMethod {
+    // Everything in the fund cost the same, its average.
+    AVERAGE,
+    // The oldest purchases are sold first.
+    FIFO,
+};
+
+inline BasisMethod parse_basis_method(const std::string& name) {
+    if (name == "average") return BasisMethod::AVERAGE;
+    if (name == "fifo") return BasisMethod::FIFO;
+    throw std::runtime_error("Unknown cost basis method '" + name + "', expected average or fifo.");
+}
+
+//
+// What was paid for the contents of a fund, so the gain on each sale can be worked out.
+//
+// FIFO needs to know what each purchase is worth now without revaluing every one of them each step, so purchases are
+// recorded as units of a price index which the fund grows along with its value (see set_index()). Purchases in the
+// same year share a lot and lots live in a fixed ring, so weekly contributions over a lifetime need no allocation. If
+// the ring still fills, the two oldest lots are merged, which only blurs the order of the oldest purchases. A sale
+// removes each lot it empties from the front, so selling is O(1) amortized.
+//
+class CostBasis {
+public:
+    static constexpr size_t CAPACITY = 64;
+
+    CostBasis() = default;
+    explicit CostBasis(BasisMethod method) : method_(method) {}
+
+    BasisMethod method() const { return method_; }
+
+    // Total paid for what's in the fund.
+    double basis() const { return basis_; }
+    size_t lots() const { return count_; }
+
+    // What a unit bought at an index of 1 is worth now, only FIFO needs it kept up to date as the fund grows.
+    bool indexed() const { return method_ == BasisMethod::FIFO; }
+    double index() const { return index_; }
+    void set_index(double index) { index_ = index; }
+
+    void buy(double amount, double year) {
+        if (amount <= 0.0) {
+            return;
+        }
+        basis_ += amount;
+        if (method_ != BasisMethod::FIFO) {
+            return;
+        }
+
+        const double units = amount / index_;
+        const double lot_year = std::floor(year);
+        if (count_ > 0 && back().year == lot_year) {
+            back().units += units;
+            back().cost += amount;
+            return;
+        }
+
+        if (count_ == CAPACITY) {
+            Lot& oldest = lots_[head_];
+            head_ = (head_ + 1) % CAPACITY;
+            count_--;
+            lots_[head_].units += oldest.units;
+            lots_[head_].cost += oldest.cost;
+        }
+        lots_[(head_ + count_) % CAPACITY] = Lot{.year = lot_year, .units = units, .cost = amount};
+        count_++;
+    }
+
+    //
+    // Records selling the given amount out of a fund worth value before the sale, returning what it cost (so the
+    // realized gain is the amount less this). Emptying the fund clears everything so no rounding is left behind.
+    //
+    double sell(double amount, double value) {
+        if (amount <= 0.0 || value <= 0.0) {
+            return 0.0;
+        }
+        if (amount >= value) {
+            const double cost = basis_;
+            clear();
+            return cost;
+        }
+
+        if (method_ == BasisMethod::AVERAGE) {
+            const double cost = basis_ * (amount / value);
+            basis_ -= cost;
+            return cost;
+        }
+
+        double units = amount / index_;
+        double cost = 0.0;
+        while (count_ > 0 && units > 0.0) {
+            Lot& lot = lots_[head_];
+            if (lot.units > units) {
+                const double part = lot.cost * (units / lot.units);
+                lot.units -= units;
+                lot.cost -= part;
+                cost += part;
+                break;
+            }
+
+            units -= lot.units;
+            cost += lot.cost;
+            head_ = (head_ + 1) % CAPACITY;
+            count_--;
+        }
+        basis_ -= cost;
+        return cost;
+    }
+
+private:
+    struct Lot {
+        double year = 0.0;
+        double units = 0.0;
+        double cost = 0.0;
+    };
+
+    Lot& back() { return lots_[(head_ + count_ - 1) % CAPACITY]; }
+
+    void clear() {
+        basis_ = 0.0;
+        head_ = 0;
+        count_ = 0;
+    }
+
+private:
+    BasisMethod method_ = BasisMethod::AVERAGE;
+    double basis_ = 0.0;
+
+    double index_ = 1.0;
+    std::array<Lot, CAPACITY> lots_{};
+    size_t head_ = 0;
+    size_t count_ = 0;
+};
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <optional>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+
+//
+// Step by step state of one simulation, recorded from the reference engine or one of the optimized engines so the two
+// can be compared.
+//
+struct Trace {
+    struct Step {
+        double year = 0.0;
+        std::vector<double> amounts;
+        bool bankrupt = false;
+    };
+    std::vector<Step> steps;
+
+    double final = 0.0;
+    bool bankrupt = false;
+    double retirement = std::numeric_limits<double>::quiet_NaN();
+};
+
+//
+// How far an engine is allowed to stray from the reference. Rounding errors are made while the balances are large and
+// stay behind as they're spent down, so the relative tolerance is of the largest balance the simulation has had so
+// far (the scale) rather than of the value itself. Engines which round differently can end up either side of
+// bankruptcy, unless exact those flips are only counted, the balances are still checked.
+//
+struct Tolerance {
+    double relative = 0.0;
+    double absolute = 0.0;
+    bool exact_bankrupt = true;
+
+    bool within(double expected, double actual, double scale) const {
+        if (std::isnan(expected) || std::isnan(actual)) {
+            return std::isnan(expected) && std::isnan(actual);
+        }
+        const double error = std::abs(actual - expected);
+        return error <= absolute || error <= relative * std::max(std::abs(expected), scale);
+    }
+};
+
+// The first place a test trace disagrees with the reference (step is the number of steps for the final results).
+struct Divergence {
+    size_t step = 0;
+    double year = 0.0;
+    std::string field;
+    double reference = 0.0;
+    double test = 0.0;
+};
+
+// Error relative to the scale, as the tolerance sees it.
+inline double relative_error(double expected, double actual, double scale) {
+    if (std::isnan(expected) || std::isnan(actual)) {
+        return std::isnan(expected) && std::isnan(actual) ? 0.0 : std::numeric_limits<double>::infinity();
+    }
+    return std::abs(actual - expected) / std::max({std::abs(expected), scale, 1.0});
+}
+
+//
+// Compares the traces of the same simulation step by step, fund by fund, returning the first value out of tolerance.
+// Traces without steps only have their results compared. The largest error seen and any bankruptcy flips (that the
+// tolerance allows) are added to the counts.
+//
+inline std::optional<Divergence> first_divergence(const Trace& reference,
+                                                  const Trace& test,
+                                                  const std::vector<std::string>& funds,
+                                                  const Tolerance& tolerance,
+                                                  double& max_error,
+                                                  size_t& bankrupt_flips) {
+    double scale = 0.0;
+    auto check = [&](size_t step, double year, const std::string& field, double expected, double actual) {
+        max_error = std::max(max_error, relative_error(expected, actual, scale));
+        return tolerance.within(expected, actual, scale) ? std::nullopt : std::optional<Divergence>(Divergence{
+            .step = step,
+            .year = year,
+            .field = field,
+            .reference = expected,
+            .test = actual
+        });
+    };
+
+    bool flipped = false;
+    auto check_bankrupt = [&](size_t step, double year, bool expected, bool actual) -> std::optional<Divergence> {
+        if (expected == actual) {
+            return std::nullopt;
+        }
+        if (!tolerance.exact_bankrupt) {
+            flipped = true;
+            return std::nullopt;
+        }
+        return Divergence{.step = step, .year = year, .field = "bankrupt", .reference = 1.0 * expected, .test = 1.0 * actual};
+    };
+
+    std::optional<Divergence> divergence;
+    if (!test.steps.empty()) {
+        if (test.steps.size() != reference.steps.size()) {
+            return Divergence{
+                .step = std::min(test.steps.size(), reference.steps.size()),
+                .field = "steps",
+                .reference = 1.0 * reference.steps.size(),
+                .test = 1.0 * test.steps.size()
+            };
+        }
+
+        for (size_t i = 0; i < reference.steps.size() && !divergence; ++i) {
+            const Trace::Step& expected = reference.steps[i];
+            const Trace::Step& actual = test.steps[i];
+            for (double amount : expected.amounts) {
+                scale = std::max(scale, std::abs(amount));
+            }
+            for (size_t f = 0; f < funds.size() && !divergence; ++f) {
+                divergence = check(i, expected.year, funds[f] + "_value", expected.amounts[f], actual.amounts[f]);
+            }
+            if (!divergence) {
+                divergence = check_bankrupt(i, expected.year, expected.bankrupt, actual.bankrupt);
+            }
+        }
+    }
+
+    scale = std::max(scale, std::abs(reference.final));
+    const size_t end = reference.steps.size();
+    const double year = reference.steps.empty() ? 0.0 : reference.steps.back().year;
+    if (!divergence) divergence = check(end, year, "final", reference.final, test.final);
+    if (!divergence) divergence = check(end, year, "retirement_value", reference.retirement, test.retirement);
+    if (!divergence) divergence = check_bankrupt(end, year, reference.bankrupt, test.bankrupt);
+
+    bankrupt_flips += flipped;
+    return divergence;
+}
+
+//
+// Running totals for one engine over every trial of a differential test, keeping the first divergence (and the trial
+// it came from) so it can be reproduced.
+//
+struct DiffReport {
+    std::string engine;
+    Tolerance tolerance;
+
+    size_t trials = 0;
+    size_t steps = 0;
+    size_t divergences = 0;
+    size_t bankrupt_flips = 0;
+    double max_error = 0.0;
+
+    std::optional<Divergence> first;
+    size_t first_trial = 0;
+
+    void add(size_t trial, const Trace& reference, const Trace& test, const std::vector<std::string>& funds) {
+        trials++;
+        steps += test.steps.size();
+        if (auto divergence = first_divergence(reference, test, funds, tolerance, max_error, bankrupt_flips)) {
+            divergences++;
+            if (!first) {
+                first = divergence;
+                first_trial = trial;
+            }
+        }
+    }
+};
+
+//
+// Draws the scenario arguments for a differential test trial, covering the parts of each model which change how the
+// engines step: jobs ending, costs with down payments, loans and closing costs landing between steps, contribution
+// limits and funds which can't be sold from until later.
+//
+inline std::vector<std::string> random_scenario(std::mt19937_64& rng) {
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    auto uniform = [&](double low, double high) { return low + (high - low) * unit(rng); };
+    auto chance = [&](double p) { return unit(rng) < p; };
+
+    std::vector<std::string> args;
+    auto add = [&](const std::string& name, double value) {
+        args.push_back("--" + name);
+        args.push_back(std::to_string(value));
+    };
+
+    add("sim-years", std::floor(uniform(1.0, 40.0)));
+
+    add("job-salary", uniform(20000.0, 250000.0));
+    add("job-rate", uniform(0.0, 0.05));
+    add("job-duration", uniform(0.0, 35.0));
+
+    add("spending-annual", uniform(10000.0, 120000.0));
+    if (chance(0.5)) {
+        args.push_back("--spending-is-exp");
+        add("spending-rate", uniform(0.0, 0.05));
+    } else {
+        add("spending-rate", uniform(0.0, 3000.0));
+    }
+
+    if (chance(0.3)) {
+        args.push_back("--spending-rule");
+        args.push_back(chance(0.5) ? "guardrail" : "percent");
+        add("spending-withdrawal-rate", uniform(0.02, 0.08));
+        if (chance(0.5)) add("spending-floor", uniform(0.5, 1.0));
+        if (chance(0.5)) add("spending-ceiling", uniform(1.0, 2.0));
+    }
+
+    for (const std::string cost : {"child", "child2", "car"}) {
+        const double total = chance(0.25) ? 0.0 : uniform(1000.0, 400000.0);
+        add(cost + "-total", total);
+        add(cost + "-start", uniform(0.0, 30.0));
+        add(cost + "-duration", uniform(0.5, 20.0));
+        if (chance(0.5)) add(cost + "-down", uniform(0.0, 0.3 * total));
+        if (chance(0.5)) add(cost + "-close", uniform(0.0, 20000.0));
+        if (chance(0.3)) add(cost + "-rate", uniform(0.0, 0.08));
+        if (chance(0.2)) add(cost + "-prepay", uniform(0.0, 20000.0));
+    }
+
+    for (const std::string fund : {"market", "retirement"}) {
+        add(fund + "-amount", chance(0.2) ? 0.0 : uniform(0.0, 1500000.0));
+        if (chance(0.5)) add(fund + "-limit", uniform(1000.0, 30000.0));
+        if (chance(0.5)) add(fund + "-start", uniform(0.0, 30.0));
+    }
+    return args;
+}
+
+inline std::string join_args(const std::vector<std::string>& args) {
+    std::string joined;
+    for (const auto& arg : args) {
+        joined += (joined.empty() ? "" : " ") + arg;
+    }
+    return joined;
+}
@@ -0,0 +1,291 @@
+#pragma once
+
+#include "batch.hh"
+#include "market_data.hh"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+//
+// Draws start dates for estimating a small chance of going bankrupt. Plain sampling spends nearly every simulation on
+// start dates which are fine, so instead some days are favoured: each day is drawn with probability
+//
+//   (1 - mix) * favoured / (number favoured) + mix / days
+//
+// and each simulation is weighted by the likelihood ratio of plain sampling to this, so the weighted mean is an
+// unbiased estimate of what plain sampling estimates whichever days are favoured. Favouring the days which go bankrupt
+// (see favoured_days()) is what cuts the variance. Drawing a share (mix) of the days uniformly keeps every weight
+// below 1 / mix, so a start date going bankrupt which wasn't favoured can't blow up the variance.
+//
+class ImportanceSampler {
+public:
+    struct Sample {
+        // Offset as a fraction of the market data, as the engines take it.
+        double percent = 0.0;
+        double weight = 1.0;
+    };
+
+    ImportanceSampler(const std::vector<uint8_t>& favoured, double mix) {
+        if (favoured.empty()) {
+            throw std::runtime_error("Importance sampling needs market data to choose start dates from.");
+        }
+        if (!(mix > 0.0 && mix <= 1.0)) {
+            throw std::runtime_error("The share of uniformly drawn start dates needs to be in (0, 1].");
+        }
+
+        const size_t days = favoured.size();
+        const size_t count = std::count_if(favoured.begin(), favoured.end(), [](uint8_t f) { return f != 0; });
+        const double favour = count > 0 ? (1.0 - mix) / count : 0.0;
+        const double uniform = count > 0 ? mix / days : 1.0 / days;
+
+        probabilities_.resize(days);
+        cumulative_.resize(days);
+        double sum = 0.0;
+        for (size_t day = 0; day < days; ++day) {
+            probabilities_[day] = uniform + (favoured[day] ? favour : 0.0);
+            sum += probabilities_[day];
+            cumulative_[day] = sum;
+        }
+    }
+
+    template <typename Rng>
+    Sample draw(Rng& rng) const {
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+        const size_t days = cumulative_.size();
+        const double u = unit(rng) * cumulative_.back();
+        const size_t day = std::min<size_t>(std::upper_bound(cumulative_.begin(), cumulative_.end(), u) -
+                                            cumulative_.begin(), days - 1);
+
+        // Anywhere within the day, which is how likely plain sampling is to land on it.
+        const double percent = std::min((day + unit(rng)) / days, std::nextafter(1.0, 0.0));
+        return {.percent = percent, .weight = cumulative_.back() / (days * probabilities_[day])};
+    }
+
+private:
+    std::vector<double> probabilities_;
+    std::vector<double> cumulative_;
+};
+
+//
+// Days worth favouring, from a pilot run of the plan from every stride'th day (as run_days() runs them): those within
+// a stride of the pilot's worst start dates by final value. Start dates which go bankrupt between the pilot's are
+// next to ones which nearly did, so as well as those which went bankrupt the near misses are favoured, margin times
+// as many as went bankrupt (and at least a share of them).
+//
+template <typename Scalar>
+std::vector<uint8_t> favoured_days(const BatchResults<Scalar>& pilot,
+                                   size_t stride,
+                                   size_t days,
+                                   double share,
+                                   double margin) {
+    const size_t ruins = std::count_if(pilot.bankrupt.begin(), pilot.bankrupt.end(), [](uint8_t b) { return b != 0; });
+    const size_t count = std::min<size_t>(std::max(std::ceil(share * pilot.size()), margin * ruins), pilot.size());
+
+    std::vector<size_t> worst(pilot.size());
+    std::iota(worst.begin(), worst.end(), 0);
+    std::partial_sort(worst.begin(), worst.begin() + count, worst.end(), [&](size_t a, size_t b) {
+        if (pilot.bankrupt[a] != pilot.bankrupt[b]) {
+            return pilot.bankrupt[a] > pilot.bankrupt[b];
+        }
+        return pilot.final[a] < pilot.final[b];
+    });
+    worst.resize(count);
+
+    std::vector<uint8_t> favoured(days);
+    for (size_t i : worst) {
+        for (size_t d = 1; d < 2 * stride; ++d) {
+            favoured[(i * stride + days + d - stride) % days] = 1;
+        }
+    }
+    return favoured;
+}
+
+//
+// The chance of going bankrupt estimated from weighted simulations (all weights 1 for plain sampling).
+//
+struct RuinEstimate {
+    size_t samples = 0;
+    size_t ruins = 0;
+
+    double probability = 0.0;
+    double standard_error = 0.0;
+
+    // How many equally weighted simulations the weights are worth (Kish), which is low when a few dominate.
+    double effective_samples = 0.0;
+
+    // Plain sampling's variance over this one's, how many times fewer simulations the weighting needed for the same
+    // standard error.
+    double variance_reduction = 1.0;
+};
+
+inline RuinEstimate estimate_ruin(const std::vector<double>& weights, const std::vector<uint8_t>& bankrupt) {
+    RuinEstimate estimate;
+    estimate.samples = weights.size();
+    if (weights.empty()) {
+        return estimate;
+    }
+
+    double sum = 0.0;
+    double weight_sum = 0.0;
+    double weight_squares = 0.0;
+    for (size_t i = 0; i < weights.size(); ++i) {
+        estimate.ruins += bankrupt[i] != 0;
+        sum += bankrupt[i] ? weights[i] : 0.0;
+        weight_sum += weights[i];
+        weight_squares += weights[i] * weights[i];
+    }
+    const double n = weights.size();
+    const double mean = sum / n;
+
+    double squares = 0.0;
+    for (size_t i = 0; i < weights.size(); ++i) {
+        const double error = (bankrupt[i] ? weights[i] : 0.0) - mean;
+        squares += error * error;
+    }
+    const double variance = n > 1 ? squares / (n - 1) : 0.0;
+
+    estimate.probability = mean;
+    estimate.standard_error = std::sqrt(variance / n);
+    estimate.effective_samples = weight_sum * weight_sum / weight_squares;
+    if (variance > 0.0) {
+        estimate.variance_reduction = mean * (1.0 - mean) / variance;
+    }
+    return estimate;
+}
+
+//
+// A control variate: the market's growth between two times (in years) into each simulation, whose mean over every
+// start date is known exactly. Lookups take the price on the day the time falls on, so over a day of start offsets
+// the growth only changes where either time crosses into the next day, and the mean is a sum over those pieces.
+//
+class GrowthControl {
+public:
+    GrowthControl(const MarketData& market, double from, double to)
+        : market_(&market), from_(from * 365.25), to_(to * 365.25) {
+        const double size = market.size();
+        double sum = 0.0;
+        for (size_t day = 0; day < market.size(); ++day) {
+            std::array<double, 4> breaks = {0.0, std::ceil(from_) - from_, std::ceil(to_) - to_, 1.0};
+            std::sort(breaks.begin(), breaks.end());
+            for (size_t b = 0; b + 1 < breaks.size(); ++b) {
+                const double length = breaks[b + 1] - breaks[b];
+                if (length > 0.0) {
+                    sum += length * growth(day + (breaks[b] + breaks[b + 1]) / 2);
+                }
+            }
+        }
+        mean_ = sum / size;
+    }
+
+    double operator()(double percent) const { return growth(percent * market_->size()); }
+    double mean() const { return mean_; }
+
+private:
+    double growth(double day_offset) const {
+        return market_->lookup(to_ + day_offset) / market_->lookup(from_ + day_offset);
+    }
+
+private:
+    const MarketData* market_ = nullptr;
+    double from_ = 0.0;
+    double to_ = 0.0;
+    double mean_ = 0.0;
+};
+
+// A mean estimated from simulations, and how many times less its variance is than the plain sample mean's.
+struct MeanEstimate {
+    size_t samples = 0;
+    double mean = 0.0;
+    double standard_error = 0.0;
+    double variance_reduction = 1.0;
+};
+
+inline MeanEstimate estimate_mean(const std::vector<double>& values) {
+    MeanEstimate estimate;
+    estimate.samples = values.size();
+    if (values.empty()) {
+        return estimate;
+    }
+
+    const double n = values.size();
+    estimate.mean = std::accumulate(values.begin(), values.end(), 0.0) / n;
+    double squares = 0.0;
+    for (double value : values) {
+        squares += (value - estimate.mean) * (value - estimate.mean);
+    }
+    estimate.standard_error = n > 1 ? std::sqrt(squares / (n - 1) / n) : 0.0;
+    return estimate;
+}
+
+//
+// The mean of values corrected by controls with known means: values - beta . (controls - means), with beta fit by
+// least squares. The more of the values' variance the controls explain, the less is left in the estimate.
+//
+inline MeanEstimate estimate_with_controls(const std::vector<double>& values,
+                                           const std::vector<std::vector<double>>& controls,
+                                           const std::vector<double>& means) {
+    const size_t n = values.size();
+    const size_t k = controls.size();
+    if (n <= k + 1) {
+        return estimate_mean(values);
+    }
+
+    // Center everything on its sample mean, then solve the normal equations (k is tiny).
+    const double y_mean = std::accumulate(values.begin(), values.end(), 0.0) / n;
+    std::vector<double> x_means(k);
+    for (size_t c = 0; c < k; ++c) {
+        x_means[c] = std::accumulate(controls[c].begin(), controls[c].end(), 0.0) / n;
+    }
+    std::vector<std::vector<double>> a(k, std::vector<double>(k + 1));
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t r = 0; r < k; ++r) {
+            const double x = controls[r][i] - x_means[r];
+            for (size_t c = 0; c < k; ++c) {
+                a[r][c] += x * (controls[c][i] - x_means[c]);
+            }
+            a[r][k] += x * (values[i] - y_mean);
+        }
+    }
+    for (size_t p = 0; p < k; ++p) {
+        const size_t pivot = std::max_element(a.begin() + p, a.end(), [&](const auto& l, const auto& r) {
+            return std::abs(l[p]) < std::abs(r[p]);
+        }) - a.begin();
+        std::swap(a[p], a[pivot]);
+        if (a[p][p] == 0.0) {
+            return estimate_mean(values);
+        }
+        for (size_t r = 0; r < k; ++r) {
+            if (r == p) {
+                continue;
+            }
+            const double factor = a[r][p] / a[p][p];
+            for (size_t c = p; c <= k; ++c) {
+                a[r][c] -= factor * a[p][c];
+            }
+        }
+    }
+
+    MeanEstimate estimate;
+    estimate.samples = n;
+    estimate.mean = y_mean;
+    for (size_t c = 0; c < k; ++c) {
+        estimate.mean -= a[c][k] / a[c][c] * (x_means[c] - means[c]);
+    }
+
+    double squares = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        double residual = values[i] - y_mean;
+        for (size_t c = 0; c < k; ++c) {
+            residual -= a[c][k] / a[c][c] * (controls[c][i] - x_means[c]);
+        }
+        squares += residual * residual;
+    }
+    estimate.standard_error = std::sqrt(squares / (n - k - 1) / n);
+    return estimate;
+}
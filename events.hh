@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+//
+// Counter based random numbers for the stochastic events. The n'th draw of a stream is a hash of (seed, simulation,
+// stream, n), so there's no generator state to carry around or share: each simulation's events only depend on its id,
+// whatever order (or thread) the simulations run in, and each model draws from its own stream so adding one doesn't
+// change what any other draws.
+//
+// An antithetic stream mirrors the draws of the same stream, each uniform u becoming 1 - u (and each normal its
+// negation), so a pair of simulations with opposite draws has less variance between them than two independent ones.
+// That only holds while the twins line up draw for draw, so each kind of draw (arrival times, lengths, amounts) needs
+// its own stream: sharing one, a different number of events in either twin would mirror one's amounts against the
+// other's arrival times.
+//
+class EventRng {
+public:
+    EventRng(uint64_t seed, uint64_t simulation, std::string_view stream, bool antithetic = false)
+        : key_(mix(mix(seed ^ mix(simulation)) ^ hash(stream))), antithetic_(antithetic) {}
+
+    // Uniform on (0, 1), never exactly either end so it can be logged.
+    double uniform() { return antithetic_ ? 1.0 - draw() : draw(); }
+
+    double exponential(double mean) { return -mean * std::log(uniform()); }
+
+    // Log normal with the given median, sigma being the standard deviation of its log (Box-Muller).
+    double lognormal(double median, double sigma) {
+        const double radius = std::sqrt(-2.0 * std::log(draw()));
+        const double normal = radius * std::cos(2.0 * M_PI * draw());
+        return median * std::exp(sigma * (antithetic_ ? -normal : normal));
+    }
+
+private:
+    double draw() { return ((mix(key_ ^ mix(counter_++)) >> 11) + 0.5) * 0x1.0p-53; }
+
+    // SplitMix64's finalizer.
+    static uint64_t mix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+    // FNV-1a, so streams are named the same way in every build.
+    static uint64_t hash(std::string_view name) {
+        uint64_t h = 0xcbf29ce484222325;
+        for (char c : name) {
+            h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+        }
+        return h;
+    }
+
+private:
+    uint64_t key_ = 0;
+    uint64_t counter_ = 0;
+    bool antithetic_ = false;
+};
+
+// Something which lasts from begin to end (in years), an instant if they're the same.
+struct Event {
+    double begin = 0.0;
+    double end = 0.0;
+    double amount = 0.0;
+};
+
+//
+// Events arriving at rate per year (a Poisson process) between begin and end, each lasting an exponential time with
+// the given mean. A new one can only arrive once the last is over, so with spells out of work the rate is the hazard
+// of losing a job while in one. The gaps between events come from one stream and their lengths from another. The
+// amounts are left for the caller.
+//
+inline std::vector<Event> poisson_events(EventRng& arrivals,
+                                         EventRng& durations,
+                                         double begin,
+                                         double end,
+                                         double rate,
+                                         double mean_duration) {
+    std::vector<Event> events;
+    if (!(rate > 0.0)) {
+        return events;
+    }
+    for (double t = begin + arrivals.exponential(1.0 / rate); t < end; t += arrivals.exponential(1.0 / rate)) {
+        const double duration = mean_duration > 0.0 ? durations.exponential(mean_duration) : 0.0;
+        events.push_back({.begin = t, .end = std::min(t + duration, end)});
+        t += duration;
+    }
+    return events;
+}
+
+//
+// Walks a sorted list of events as a simulation steps forward, so each step only looks at the events it overlaps.
+//
+class EventCursor {
+public:
+    EventCursor() = default;
+    explicit EventCursor(std::vector<Event> events) : events_(std::move(events)) {}
+
+    bool empty() const { return events_.empty(); }
+
+    // Total time covered by the events over (from, to].
+    double covered(double from, double to) {
+        skip(from);
+        double covered = 0.0;
+        for (size_t e = next_; e < events_.size() && events_[e].begin < to; ++e) {
+            covered += std::max(std::min(events_[e].end, to) - std::max(events_[e].begin, from), 0.0);
+        }
+        return covered;
+    }
+
+    // Total amount of the events beginning over (from, to].
+    double arrived(double from, double to) {
+        skip(from);
+        double amount = 0.0;
+        for (size_t e = next_; e < events_.size() && events_[e].begin <= to; ++e) {
+            amount += events_[e].begin > from ? events_[e].amount : 0.0;
+        }
+        return amount;
+    }
+
+    // If an event covers the time t.
+    bool active(double t) const {
+        for (size_t e = next_; e < events_.size() && events_[e].begin < t; ++e) {
+            if (t <= events_[e].end) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    // Steps past everything over by from, which later steps can't need.
+    void skip(double from) {
+        while (next_ < events_.size() && events_[next_].end <= from) {
+            next_++;
+        }
+    }
+
+private:
+    std::vector<Event> events_;
+    size_t next_ = 0;
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "market_data.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+//
+// Cumulative inflation over one simulation: the CPI on each step relative to the first day, looked up at the same day
+// offset as the market funds so inflation and returns come from the same stretch of history. The CPI series is read
+// like the market data (memory mapped daily floats, wrapping around the same way), and the factors are worked out once
+// per simulation with a lookup per step, after which indexing an amount on any step is a multiply.
+//
+class Inflation {
+public:
+    Inflation(const MarketData& cpi, double day_offset, double period, double years) : period_(period) {
+        const double start = cpi.lookup(day_offset);
+        for (size_t i = 0; i * period <= years; ++i) {
+            factors_.push_back(cpi.lookup(i * period * 365.25 + day_offset) / start);
+        }
+    }
+
+    // Prices on the step at the given year relative to the start (the last step's after the end).
+    double operator()(double year) const {
+        const size_t step = std::max<long>(std::lround(year / period_), 0);
+        return factors_[std::min(step, factors_.size() - 1)];
+    }
+
+private:
+    double period_ = 1.0;
+    std::vector<double> factors_;
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <dlfcn.h>
+#include <unistd.h>
+
+//
+// Compiles generated C++ into shared objects and loads them, for engines which specialize themselves to the shape of
+// what they run. The source is compiled with the local compiler ($CXX, or c++) into a cache directory named by a hash
+// of the source, so a shape is only compiled once across runs, then dlopen'd. Generated code includes this
+// repository's headers (found next to this one) and reads the engine's structures directly, so the hash also covers
+// the build of the program that generated it. Kernels are built for the machine they're compiled on, so it covers
+// the resolved target too, and a cache shared between machines only hands each the kernels built for its CPU.
+//
+// Everything is off until a cache directory is set, and any failure (no compiler, headers moved, ...) just means no
+// kernel, which callers fall back from.
+//
+class KernelCache {
+public:
+    struct Stats {
+        size_t compiled = 0;
+        size_t cached = 0;
+        size_t failed = 0;
+    };
+
+    static void enable(std::string directory) {
+        std::lock_guard lock(mutex_);
+        directory_ = std::move(directory);
+    }
+    static bool enabled() {
+        std::lock_guard lock(mutex_);
+        return !directory_.empty();
+    }
+
+    //
+    // The address of the named function in the compiled source, or nullptr if it couldn't be compiled or loaded. Only
+    // one thread compiles at a time, anything already loaded by this process is reused.
+    //
+    static void* find(const std::string& source, const std::string& function) {
+        std::lock_guard lock(mutex_);
+        if (directory_.empty()) {
+            return nullptr;
+        }
+
+        const std::string command = compiler() + " -std=c++20 -O3 -march=native -ffp-contract=off -fPIC -shared -I'" +
+            include_directory() + "'";
+        const std::string name =
+            "kernel_" + hex(hash(source + "\n" + command + "\n" + target() + "\n" + __DATE__ " " __TIME__));
+        if (auto it = loaded_.find(name); it != loaded_.end()) {
+            return it->second;
+        }
+
+        const std::filesystem::path base = std::filesystem::path(directory_) / name;
+        const std::string library = base.string() + ".so";
+        void* handle = nullptr;
+        if (std::filesystem::exists(library)) {
+            handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+            stats_.cached += handle != nullptr;
+        }
+        if (!handle && compile(source, base, command)) {
+            handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+            stats_.compiled += handle != nullptr;
+        }
+
+        void* address = handle ? dlsym(handle, function.c_str()) : nullptr;
+        stats_.failed += address == nullptr;
+        loaded_[name] = address;
+        return address;
+    }
+
+    static Stats stats() {
+        std::lock_guard lock(mutex_);
+        return stats_;
+    }
+
+private:
+    static std::string compiler() {
+        const char* cxx = std::getenv("CXX");
+        return cxx && *cxx ? cxx : "c++";
+    }
+
+    //
+    // What -march=native resolves to here: the compiler's target options (every instruction set extension it enables)
+    // where it can list them, and the CPU's model and flags either way. Worked out once per process.
+    //
+    static const std::string& target() {
+        static const std::string target = []() {
+            std::string out;
+            const std::string command = compiler() + " -march=native -Q --help=target 2>/dev/null";
+            if (FILE* pipe = popen(command.c_str(), "r")) {
+                char buffer[4096];
+                for (size_t read; (read = std::fread(buffer, 1, sizeof(buffer), pipe)) > 0;) {
+                    out.append(buffer, read);
+                }
+                pclose(pipe);
+            }
+
+            std::ifstream cpuinfo("/proc/cpuinfo");
+            bool model = false;
+            bool flags = false;
+            for (std::string line; (!model || !flags) && std::getline(cpuinfo, line);) {
+                if (!model && line.starts_with("model name")) {
+                    out += line + "\n";
+                    model = true;
+                } else if (!flags && line.starts_with("flags")) {
+                    out += line + "\n";
+                    flags = true;
+                }
+            }
+            return out;
+        }();
+        return target;
+    }
+
+    // Where this header is, __FILE__ is relative to wherever the program was built from.
+    static std::string include_directory() {
+        const std::filesystem::path directory = std::filesystem::path(__FILE__).parent_path();
+        return std::filesystem::absolute(directory.empty() ? "." : directory).string();
+    }
+
+    // Compiles to a temporary name first, so other processes sharing the cache never load a partly written library.
+    static bool compile(const std::string& source, const std::filesystem::path& base, const std::string& command) {
+        std::error_code error;
+        std::filesystem::create_directories(base.parent_path(), error);
+
+        // The source (and the compiler's output) are kept next to the library, to see what was generated.
+        const std::string pid = std::to_string(getpid());
+        const std::string cc = base.string() + "." + pid + ".cc";
+        const std::string temporary = base.string() + ".so." + pid;
+        std::ofstream(cc) << source;
+
+        const std::string full = command + " -o '" + temporary + "' '" + cc + "' > '" + base.string() + ".log' 2>&1";
+        const bool compiled = std::system(full.c_str()) == 0;
+        std::filesystem::rename(cc, base.string() + ".cc", error);
+        if (!compiled) {
+            std::filesystem::remove(temporary, error);
+            return false;
+        }
+        std::filesystem::rename(temporary, base.string() + ".so", error);
+        return !error;
+    }
+
+    // FNV-1a, stable between runs and builds (unlike std::hash).
+    static uint64_t hash(const std::string& text) {
+        uint64_t hash = 0xcbf29ce484222325;
+        for (unsigned char c : text) {
+            hash = (hash ^ c) * 0x100000001b3;
+        }
+        return hash;
+    }
+    static std::string hex(uint64_t value) {
+        char out[17];
+        std::snprintf(out, sizeof(out), "%016lx", static_cast<unsigned long>(value));
+        return out;
+    }
+
+private:
+    inline static std::mutex mutex_;
+    inline static std::string directory_;
+    inline static std::map<std::string, void*> loaded_;
+    inline static Stats stats_{0, 0, 0};
+};
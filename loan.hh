@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+//
+// An amortizing loan in continuous time: interest compounds continuously at rate while the borrower pays a constant
+// stream (the payment, plus any prepayment, per year) until the balance is gone. The payment which pays the principal
+// off over the term is
+//
+//   payment = rate * principal / (1 - exp(-rate * term))
+//
+// and the balance t years in is principal * exp(rate * t) - paying * (exp(rate * t) - 1) / rate. Since what's paid
+// per year is constant until the payoff, the amount paid over any interval is a single multiply, so a loan can be
+// stepped weekly or jumped between events at the same cost. Only the balance needs an exp().
+//
+class Loan {
+public:
+    Loan() = default;
+
+    // An infinite term pays only the interest (unless prepaid), a rate of 0 pays the principal off evenly. Without a
+    // term nothing is paid, the whole balance is left owing.
+    Loan(double principal, double rate, double term, double prepayment = 0.0)
+        : principal_(std::max(principal, 0.0)), rate_(rate) {
+        if (!(term > 0.0)) {
+            payoff_ = std::numeric_limits<double>::infinity();
+            return;
+        }
+
+        if (rate_ > 0.0) {
+            payment_ = rate_ * principal_ / -std::expm1(-rate_ * term);
+        } else {
+            payment_ = principal_ / term;
+        }
+
+        paying_ = payment_ + std::max(prepayment, 0.0);
+        if (principal_ == 0.0) {
+            payoff_ = 0.0;
+        } else if (paying_ <= rate_ * principal_) {
+            // Not even covering the interest.
+            payoff_ = std::numeric_limits<double>::infinity();
+        } else if (rate_ > 0.0) {
+            payoff_ = -std::log1p(-rate_ * principal_ / paying_) / rate_;
+        } else {
+            payoff_ = principal_ / paying_;
+        }
+
+        // Without a prepayment the loan is paid off at the end of the term, not a rounding error either side of it.
+        if (prepayment <= 0.0) {
+            payoff_ = std::min(payoff_, term);
+        }
+    }
+
+    // Scheduled payment per year, and what's paid per year including the prepayment.
+    double payment() const { return payment_; }
+    double paying() const { return paying_; }
+
+    // Years until the balance is paid off (infinite if it never is).
+    double payoff() const { return payoff_; }
+
+    // Balance owed t years into the loan.
+    double balance(double t) const {
+        t = std::clamp(t, 0.0, payoff_);
+        if (t == payoff_) {
+            return 0.0;
+        }
+        const double balance = rate_ > 0.0
+            ? principal_ * std::exp(rate_ * t) - paying_ * std::expm1(rate_ * t) / rate_
+            : principal_ - paying_ * t;
+        return std::max(balance, 0.0);
+    }
+
+    // Paid between from and to years into the loan.
+    double paid(double from, double to) const {
+        return paying_ * (std::clamp(to, 0.0, payoff_) - std::clamp(from, 0.0, payoff_));
+    }
+
+    // Interest charged between from and to years into the loan.
+    double interest(double from, double to) const { return paid(from, to) - (balance(from) - balance(to)); }
+
+private:
+    double principal_ = 0.0;
+    double rate_ = 0.0;
+
+    double payment_ = 0.0;
+    double paying_ = 0.0;
+    double payoff_ = 0.0;
+};
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//
+// Daily price series memory mapped from disk (or compressed in memory). This is read only, so a single instance is
+// shared between all of the funds (and engines) which need it.
+//
+class MarketData {
+public:
+    using Ptr = std::shared_ptr<const MarketData>;
+
+    explicit MarketData(const std::string& path) {
+        fd_ = open(path.c_str(), O_RDONLY);
+        if (fd_ == -1) {
+            throw std::runtime_error("Failed to open " + path);
+        }
+
+        struct stat file_stat;
+        if (fstat(fd_, &file_stat) == -1) {
+            throw std::runtime_error("Failed to get file stat");
+        }
+
+        void* map = mmap(0, file_stat.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+        if (map == MAP_FAILED) {
+            throw std::runtime_error("Failed to map file");
+        }
+
+        data_ = static_cast<const float*>(map);
+        size_ = file_stat.st_size / sizeof(float);
+        set_wrap_around_multiplier(data_[size_ - 1] / data_[0]);
+    }
+
+    ~MarketData() {
+        if (data_ && owned_.empty()) munmap(const_cast<float*>(data_), size_ * sizeof(float));
+        if (fd_ != -1) close(fd_);
+    }
+
+    //
+    // Re-encodes the prices as linear deltas quantized to 16 bits with a step per block, about half the size of the
+    // raw floats. Each day stores its price less the first day's in the block (rather than the previous day's) so a
+    // price decodes on its own with a single multiply add, and every decoded price is within half a step of the
+    // original.
+    //
+    static Ptr compress(const MarketData& raw) {
+        auto compressed = std::shared_ptr<MarketData>(new MarketData());
+        compressed->size_ = raw.size_;
+        compressed->set_wrap_around_multiplier(raw.wrap_around_multiplier_);
+        compressed->deltas_.resize(raw.size_);
+        compressed->blocks_.resize((raw.size_ + BLOCK - 1) / BLOCK);
+
+        for (size_t b = 0; b < compressed->blocks_.size(); ++b) {
+            const size_t first = b * BLOCK;
+            const size_t last = std::min(first + BLOCK, raw.size_);
+            Block& block = compressed->blocks_[b];
+            block.anchor = raw.data_[first];
+
+            double max_change = 0.0;
+            for (size_t i = first + 1; i < last; ++i) {
+                max_change = std::max(max_change, std::abs(static_cast<double>(raw.data_[i]) - block.anchor));
+            }
+            // Leave some headroom for the step being rounded to a float.
+            block.step = max_change > 0.0 ? max_change / (INT16_MAX - 1) : 1.0;
+
+            for (size_t i = first; i < last; ++i) {
+                compressed->deltas_[i] = std::lround((static_cast<double>(raw.data_[i]) - block.anchor) / block.step);
+            }
+        }
+
+        for (size_t i = 0; i < raw.size_; ++i) {
+            compressed->max_error_ = std::max(compressed->max_error_,
+                                              std::abs(compressed->price(i) / raw.data_[i] - 1.0));
+        }
+
+        return compressed;
+    }
+
+    //
+    // A copy held in memory allocated (and first touched) by the calling thread, so on NUMA machines it lives on the
+    // caller's node.
+    //
+    static Ptr copy(const MarketData& data) {
+        auto copy = std::shared_ptr<MarketData>(new MarketData());
+        copy->size_ = data.size_;
+        copy->set_wrap_around_multiplier(data.wrap_around_multiplier_);
+        copy->deltas_ = data.deltas_;
+        copy->blocks_ = data.blocks_;
+        copy->max_error_ = data.max_error_;
+        if (data.data_) {
+            copy->owned_.assign(data.data_, data.data_ + data.size_);
+            copy->data_ = copy->owned_.data();
+        }
+        return copy;
+    }
+
+    MarketData(const MarketData&) = delete;
+    MarketData& operator=(const MarketData&) = delete;
+
+public:
+    size_t size() const { return size_; }
+    bool compressed() const { return !blocks_.empty(); }
+    double wrap_around_multiplier() const { return wrap_around_multiplier_; }
+
+    // Price on the given (fractional) day since the start of the data. Past the end the data wraps around to the start
+    // as many times as needed, scaled each time so the series is continuous.
+    double lookup(double day) const {
+        size_t before = std::floor(day);
+
+        // Easy case, within the orignal data
+        if (before < size_) {
+            return price(before);
+        }
+
+        // Multiplying by the reciprocal can be one cycle off either way, which is still cheaper to fix than dividing.
+        int64_t cycle = before * inverse_size_;
+        int64_t wrapped = before - cycle * size_;
+        if (wrapped < 0) {
+            cycle--;
+            wrapped += size_;
+        } else if (wrapped >= static_cast<int64_t>(size_)) {
+            cycle++;
+            wrapped -= size_;
+        }
+
+        return cycle_multiplier(cycle) * price(wrapped);
+    }
+
+    // Size of the prices in memory.
+    size_t bytes() const {
+        return compressed() ? deltas_.size() * sizeof(int16_t) + blocks_.size() * sizeof(Block) : size_ * sizeof(float);
+    }
+
+    // Largest relative error of any price compared to the raw data (0 if this isn't compressed).
+    double max_error() const { return max_error_; }
+
+private:
+    MarketData() = default;
+
+    void set_wrap_around_multiplier(double multiplier) {
+        wrap_around_multiplier_ = multiplier;
+        inverse_size_ = 1.0 / size_;
+
+        cycle_multipliers_[0] = 1.0;
+        for (size_t i = 1; i < cycle_multipliers_.size(); ++i) {
+            cycle_multipliers_[i] = cycle_multipliers_[i - 1] * wrap_around_multiplier_;
+        }
+    }
+
+    double cycle_multiplier(size_t cycle) const {
+        if (cycle < cycle_multipliers_.size()) {
+            return cycle_multipliers_[cycle];
+        }
+        return std::pow(wrap_around_multiplier_, cycle);
+    }
+
+    double price(size_t day) const {
+        if (!compressed()) {
+            return data_[day];
+        }
+
+        const Block& block = blocks_[day / BLOCK];
+        return block.anchor + static_cast<double>(block.step) * deltas_[day];
+    }
+
+private:
+    static constexpr size_t BLOCK = 64;
+    struct Block {
+        // Price on the first day of the block, and the price change of each quantization step.
+        float anchor;
+        float step;
+    };
+
+    int fd_ = -1;
+    const float* data_ = nullptr;
+
+    // Backs data_ for copies, rather than the mapped file.
+    std::vector<float> owned_;
+    size_t size_ = 0;
+
+    double wrap_around_multiplier_ = 0.0;
+    double inverse_size_ = 0.0;
+
+    // Scale of the data on each trip through it, far more cycles than any simulation needs.
+    std::array<double, 64> cycle_multipliers_;
+
+    // Each day's price less its block's anchor, in steps.
+    std::vector<int16_t> deltas_;
+    std::vector<Block> blocks_;
+    double max_error_ = 0.0;
+};
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+//
+// The machine's NUMA nodes and the CPUs on each (of those this process is allowed to run on), read from sysfs. Machines
+// (or containers) without NUMA information look like a single node with every CPU.
+//
+class Topology {
+public:
+    struct Node {
+        int id = 0;
+        std::vector<int> cpus;
+        size_t memory_mb = 0;
+
+        // Relative cost of reaching each node's memory from this one (10 is local).
+        std::vector<int> distances;
+    };
+
+    static Topology detect() {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            CPU_SET(0, &allowed);
+        }
+
+        Topology topology;
+        for (int id : parse_list(read_file("/sys/devices/system/node/online"))) {
+            const std::string path = "/sys/devices/system/node/node" + std::to_string(id);
+            Node node;
+            node.id = id;
+            for (int cpu : parse_list(read_file(path + "/cpulist"))) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                    node.cpus.push_back(cpu);
+                }
+            }
+            if (node.cpus.empty()) {
+                continue;
+            }
+
+            std::stringstream meminfo(read_file(path + "/meminfo"));
+            for (std::string line; std::getline(meminfo, line);) {
+                if (auto at = line.find("MemTotal:"); at != std::string::npos) {
+                    node.memory_mb = std::stoull(line.substr(at + 9)) / 1024;
+                }
+            }
+            std::stringstream distances(read_file(path + "/distance"));
+            for (int distance; distances >> distance;) {
+                node.distances.push_back(distance);
+            }
+            topology.nodes_.push_back(std::move(node));
+        }
+
+        if (topology.nodes_.empty()) {
+            Node& node = topology.nodes_.emplace_back();
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &allowed)) {
+                    node.cpus.push_back(cpu);
+                }
+            }
+        }
+        return topology;
+    }
+
+    //
+    // Splits the CPUs into the given number of nodes, to try out per node replication on a machine without NUMA. With
+    // more nodes than CPUs, the CPUs are shared.
+    //
+    Topology split(size_t count) const {
+        std::vector<int> cpus;
+        for (const auto& node : nodes_) {
+            cpus.insert(cpus.end(), node.cpus.begin(), node.cpus.end());
+        }
+        count = std::max<size_t>(count, 1);
+
+        Topology topology;
+        for (size_t n = 0; n < count; ++n) {
+            Node& node = topology.nodes_.emplace_back();
+            node.id = n;
+            for (size_t c = n * cpus.size() / count; c < (n + 1) * cpus.size() / count; ++c) {
+                node.cpus.push_back(cpus[c]);
+            }
+            if (node.cpus.empty()) {
+                node.cpus.push_back(cpus[n % cpus.size()]);
+            }
+        }
+        return topology;
+    }
+
+public:
+    const std::vector<Node>& nodes() const { return nodes_; }
+
+    // Index of the node a worker thread runs on, threads are dealt out to the nodes in turn so any number of threads
+    // is spread evenly.
+    size_t node_of(size_t thread) const { return thread % nodes_.size(); }
+
+    // CPU a worker thread is pinned to, threads on the same node fill its CPUs in order.
+    int cpu_of(size_t thread) const {
+        const Node& node = nodes_[node_of(thread)];
+        return node.cpus[(thread / nodes_.size()) % node.cpus.size()];
+    }
+
+    void report(std::ostream& os, size_t threads) const {
+        os << "node,cpus,memory_mb,distances\n";
+        for (const auto& node : nodes_) {
+            os << node.id << "," << join(node.cpus, " ") << "," << node.memory_mb << "," << join(node.distances, " ")
+               << "\n";
+        }
+        os << "thread,node,cpu\n";
+        for (size_t thread = 0; thread < threads; ++thread) {
+            os << thread << "," << nodes_[node_of(thread)].id << "," << cpu_of(thread) << "\n";
+        }
+    }
+
+private:
+    static std::string read_file(const std::string& path) {
+        std::ifstream file(path);
+        std::stringstream ss;
+        ss << file.rdbuf();
+        return ss.str();
+    }
+
+    // Parses kernel lists like "0-3,8-11".
+    static std::vector<int> parse_list(const std::string& list) {
+        std::vector<int> values;
+        std::stringstream ss(list);
+        for (std::string range; std::getline(ss, range, ',');) {
+            try {
+                const size_t dash = range.find('-');
+                const int first = std::stoi(range.substr(0, dash));
+                const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int value = first; value <= last; ++value) {
+                    values.push_back(value);
+                }
+            } catch (const std::exception&) {
+                // Blank or malformed, skip it
+            }
+        }
+        return values;
+    }
+
+    static std::string join(const std::vector<int>& values, const std::string& separator) {
+        std::string out;
+        for (size_t i = 0; i < values.size(); ++i) {
+            out += (i > 0 ? separator : "") + std::to_string(values[i]);
+        }
+        return out;
+    }
+
+private:
+    std::vector<Node> nodes_;
+};
+
+// Pins the calling thread to a CPU. Returns false if the CPU isn't available, the thread then runs anywhere.
+inline bool pin_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+//
+// How the batched engine spreads work over threads. When pinning, each worker is pinned to a CPU with threads spread
+// evenly across the NUMA nodes, and on machines with more than one node everything read by the workers (market data
+// and schedules) is copied once per node by the first worker there, so every worker reads memory local to it.
+//
+struct Workers {
+    size_t threads = 1;
+    bool pin = false;
+    Topology topology;
+
+    bool pinned() const { return pin && !topology.nodes().empty(); }
+    bool replicate() const { return pinned() && topology.nodes().size() > 1; }
+};
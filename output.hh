@@ -0,0 +1,96 @@
+#pragma once
+
+#include "batch.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <string>
+
+//
+// Running statistics of the final values from a set of simulations. Partial statistics from separate threads can be
+// merged, merging in a fixed order gives the same result regardless of which thread computed what.
+//
+struct Statistics {
+    size_t count = 0;
+    size_t bankrupt = 0;
+
+    double mean = 0.0;
+    double m2 = 0.0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+
+    void add(double final, bool is_bankrupt) {
+        count++;
+        bankrupt += is_bankrupt;
+
+        const double delta = final - mean;
+        mean += delta / count;
+        m2 += delta * (final - mean);
+        min = std::min(min, final);
+        max = std::max(max, final);
+    }
+
+    void merge(const Statistics& rhs) {
+        if (rhs.count == 0) {
+            return;
+        }
+
+        const size_t total = count + rhs.count;
+        const double delta = rhs.mean - mean;
+        mean += delta * rhs.count / total;
+        m2 += rhs.m2 + delta * delta * count * rhs.count / total;
+        count = total;
+        bankrupt += rhs.bankrupt;
+        min = std::min(min, rhs.min);
+        max = std::max(max, rhs.max);
+    }
+
+    double stddev() const { return count > 1 ? std::sqrt(m2 / (count - 1)) : 0.0; }
+};
+
+// Statistics for one schedule over one tile of a sweep, built up by the thread that ran the tile.
+struct TileOutput {
+    size_t schedule = 0;
+    size_t first = 0;
+
+    Statistics statistics;
+
+    bool operator<(const TileOutput& rhs) const {
+        return schedule != rhs.schedule ? schedule < rhs.schedule : first < rhs.first;
+    }
+};
+
+// Formats results as start,final,status,retirement_value rows (after the prefix), matching the reference output.
+template <typename Scalar>
+void format_rows(const double* percents, const BatchResults<Scalar>& results, const std::string& prefix, std::string& out) {
+    char row[128];
+    for (size_t id = 0; id < results.size(); ++id) {
+        const int length = std::snprintf(row, sizeof(row), "%.5f,%.2f,%s,%.2f\n",
+                                          percents[id],
+                                          Money<Scalar>::to_dollars(results.final[id]),
+                                          results.bankrupt[id] ? "bankrupt" : "okay",
+                                          Money<Scalar>::to_dollars(results.retirement[id]));
+        out += prefix;
+        out.append(row, std::min<size_t>(length, sizeof(row) - 1));
+    }
+}
+
+inline void write_summary_header(std::string& out) {
+    out += "sweep,count,bankrupt,bankrupt_rate,mean_final,stddev_final,min_final,max_final\n";
+}
+
+inline void format_summary(size_t schedule, const Statistics& statistics, std::string& out) {
+    char row[256];
+    const int length = std::snprintf(row, sizeof(row), "%zu,%zu,%zu,%.5f,%.2f,%.2f,%.2f,%.2f\n",
+                                     schedule,
+                                     statistics.count,
+                                     statistics.bankrupt,
+                                     statistics.count > 0 ? static_cast<double>(statistics.bankrupt) / statistics.count : 0.0,
+                                     statistics.mean,
+                                     statistics.stddev(),
+                                     statistics.min,
+                                     statistics.max);
+    out.append(row, std::min<size_t>(length, sizeof(row) - 1));
+}
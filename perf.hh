@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+//
+// Counts a hardware event for the calling thread, and any threads it starts while counting, with perf_event_open.
+// Many containers and VMs don't expose the counters, so check available() before trusting the counts.
+//
+class PerfCounter {
+public:
+    static PerfCounter cache_misses() { return PerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES); }
+    static PerfCounter l1_misses() {
+        return PerfCounter(PERF_TYPE_HW_CACHE,
+                           PERF_COUNT_HW_CACHE_L1D |
+                           (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    }
+
+    PerfCounter(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~PerfCounter() {
+        if (fd_ != -1) close(fd_);
+    }
+
+    PerfCounter(PerfCounter&& rhs) : fd_(rhs.fd_) { rhs.fd_ = -1; }
+    PerfCounter(const PerfCounter&) = delete;
+    PerfCounter& operator=(const PerfCounter&) = delete;
+
+public:
+    bool available() const { return fd_ != -1; }
+
+    void start() {
+        if (!available()) return;
+        ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    // Events since start(), which includes threads that have finished by now.
+    uint64_t stop() {
+        uint64_t count = 0;
+        if (!available()) return count;
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+            count = 0;
+        }
+        return count;
+    }
+
+private:
+    int fd_ = -1;
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+//
+// How a simulation draws on its funds, on top of the cash flows in its schedule. The default sells the funds in
+// order to cover exactly what the schedule needs.
+//
+// Other spending rules react to how the portfolio is doing once retired, changing what the spending model (not the
+// other expenses) spends. The portfolio is totalled at the start of each year (once the step's growth and
+// contributions are in) and the rule sets the year's spending from it.
+//
+struct Policy {
+    enum class Spending {
+        // Spend what was planned.
+        FIXED,
+        // Spend what was planned, scaled by a factor which is cut when the last year's spending was above the upper
+        // guardrail (rate * (1 + band) of the portfolio) and raised when below the lower one.
+        GUARDRAIL,
+        // Spend rate of what the portfolio was worth at the start of the year, kept between floor and ceiling times
+        // what was planned.
+        PERCENT,
+    };
+
+    // Funds in the order they're sold from (indices into the schedule's funds), empty sells them in order.
+    std::vector<size_t> order;
+
+    Spending spending = Spending::FIXED;
+
+    // Withdrawal rate (of the portfolio per year) that PERCENT spends and GUARDRAIL keeps around.
+    double rate = 0.04;
+
+    // GUARDRAIL: how far the withdrawal rate can stray from rate (as a fraction of it) before the spending changes,
+    // and how much it changes by.
+    double band = 0.2;
+    double adjust = 0.1;
+
+    // PERCENT: the least and most that can be spent, as multiples of what was planned.
+    double floor = 0.0;
+    double ceiling = std::numeric_limits<double>::infinity();
+
+    bool fixed() const { return spending == Spending::FIXED; }
+
+    //
+    // The arithmetic of the rules, shared by the reference and (inlined into loops over the lanes) the batched
+    // engines so both make exactly the same decisions. Everything is in dollars.
+    //
+
+    // What a guardrail scale is multiplied by at the start of a year, given the last year's spending.
+    double guardrail(double spent, double total) const {
+        const bool cut = spent > rate * (1.0 + band) * total;
+        const bool raise = spent > 0 && spent < rate * (1.0 - band) * total;
+        return 1.0 - adjust * cut + adjust * raise;
+    }
+
+    // What's spent on a step of dt years, with the year's budget (rate of the portfolio) and the planned spending.
+    // Nothing planned makes the ceiling NaN rather than 0, which std::min ignores.
+    double percent(double budget, double dt, double planned) const {
+        return std::min(std::max(budget * dt, floor * planned), ceiling * planned);
+    }
+
+    // What's withdrawn on a step once the spending changes from what was planned.
+    static double withdrawal(double to_spend, double planned, double spent) {
+        return std::max(to_spend + (spent - planned), 0.0);
+    }
+};
+
+inline Policy::Spending parse_spending(const std::string& name) {
+    if (name == "fixed") return Policy::Spending::FIXED;
+    if (name == "guardrail") return Policy::Spending::GUARDRAIL;
+    if (name == "percent") return Policy::Spending::PERCENT;
+    throw std::runtime_error("Unknown spending policy '" + name + "', expected fixed, guardrail or percent.");
+}
@@ -0,0 +1,83 @@
+#include "args.hh"
+#include "column_store.hh"
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+//
+// Answers questions like "what's the success rate where job-duration > 8 and spending-rate < 50" from a column store
+// written by simulate --store. Build with:
+//
+//   clang++ -std=c++20 query_results.cc -O3 -o build/query_results
+//
+int main(int argc, const char** argv) {
+    ArgumentParser parser;
+
+    std::string path;
+    parser.add_argument("--store", {
+        .callback=[&path](const auto& p){ path = std::get<std::string>(p); },
+        .description = "column store written by simulate --store",
+        .value = path
+    });
+    std::string where;
+    parser.add_argument("--where", {
+        .callback=[&where](const auto& p){ where = std::get<std::string>(p); },
+        .description = "filters like 'job-duration > 8 and spending-rate < 50' (comparing with <, <=, >, >=, == or !=)",
+        .value = where
+    });
+    std::string aggregate = "final";
+    parser.add_argument("--column", {
+        .callback=[&aggregate](const auto& p){ aggregate = std::get<std::string>(p); },
+        .description = "column to report the mean, min and max of",
+        .value = aggregate
+    });
+    bool list = false;
+    parser.add_argument("--list-columns", {
+        .callback=[&list](const auto& p){ list = std::get<bool>(p); },
+        .description = "print the columns in the store",
+        .is_flag=true
+    });
+    bool explain = false;
+    parser.add_argument("--explain", {
+        .callback=[&explain](const auto& p){ explain = std::get<bool>(p); },
+        .description = "report (on stderr) how many blocks the zone maps skipped and how long the query took",
+        .is_flag=true
+    });
+
+    parser.parse(argc, argv);
+
+    try {
+        const ColumnStore store(path);
+        if (list) {
+            for (const auto& column : store.columns()) {
+                std::cout << column << "\n";
+            }
+            return 0;
+        }
+
+        const auto predicates = store.parse(where);
+        const auto start = std::chrono::steady_clock::now();
+        const QueryResult result = store.query(predicates, store.column(aggregate), store.column("bankrupt"));
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::printf("rows,bankrupt,success_rate,mean_%s,min_%s,max_%s\n", aggregate.c_str(), aggregate.c_str(), aggregate.c_str());
+        std::printf("%zu,%zu,%.5f,%.2f,%.2f,%.2f\n",
+                    result.rows,
+                    result.bankrupt,
+                    result.rows > 0 ? 1.0 - static_cast<double>(result.bankrupt) / result.rows : 0.0,
+                    result.values > 0 ? result.sum / result.values : 0.0,
+                    result.values > 0 ? result.min : 0.0,
+                    result.values > 0 ? result.max : 0.0);
+
+        if (explain) {
+            std::cerr << store.rows() << " rows, scanned " << result.blocks_scanned << " blocks and skipped "
+                      << result.blocks_skipped << " in " << elapsed.count() << "s\n";
+        }
+    } catch (const std::runtime_error& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include "args.hh"
+#include "compress.hh"
+#include "shm_ring.hh"
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+//
+// Reads output written by simulate with --compress, or results published with --shm-ring. Build with:
+//
+//   clang++ -std=c++20 read_output.cc -O3 -o build/read_output
+//
+int main(int argc, const char** argv) {
+    ArgumentParser parser;
+
+    std::string input;
+    parser.add_argument("--input", {
+        .callback=[&input](const auto& p){ input = std::get<std::string>(p); },
+        .description = "file written with simulate --compress",
+        .value = input
+    });
+    size_t from_id = 0;
+    parser.add_argument("--from-id", {
+        .callback=[&from_id](const auto& p){ from_id = std::get<double>(p); },
+        .description = "skip straight to the frame holding this simulation id (the header row is always printed)",
+        .value = static_cast<double>(from_id)
+    });
+    bool index = false;
+    parser.add_argument("--index", {
+        .callback=[&index](const auto& p){ index = std::get<bool>(p); },
+        .description = "print the frame index rather than the output",
+        .is_flag=true
+    });
+
+    std::string shm;
+    parser.add_argument("--shm", {
+        .callback=[&shm](const auto& p){ shm = std::get<std::string>(p); },
+        .description = "read results from the simulate --shm-ring with this name (start either first) rather than a file",
+        .value = shm
+    });
+    bool count_only = false;
+    parser.add_argument("--count", {
+        .callback=[&count_only](const auto& p){ count_only = std::get<bool>(p); },
+        .description = "with --shm, only report how many results were read and how quickly",
+        .is_flag=true
+    });
+
+    parser.parse(argc, argv);
+
+    if (!shm.empty()) {
+        try {
+            ShmRingReader reader(shm);
+            size_t count = 0;
+            std::string out = count_only ? "" : "id,sweep,start,final,status,retirement_value\n";
+            const auto start = std::chrono::steady_clock::now();
+            for (auto records = reader.wait(); !records.empty(); records = reader.wait()) {
+                if (!count_only) {
+                    char row[160];
+                    for (const ResultRecord& record : records) {
+                        const int length = std::snprintf(row, sizeof(row), "%lu,%u,%.5f,%.2f,%s,%.2f\n",
+                                                         static_cast<unsigned long>(record.id),
+                                                         record.schedule,
+                                                         record.start,
+                                                         record.final,
+                                                         record.bankrupt ? "bankrupt" : "okay",
+                                                         record.retirement);
+                        out.append(row, std::min<size_t>(length, sizeof(row) - 1));
+                    }
+                    std::cout << out;
+                    out.clear();
+                }
+                count += records.size();
+                reader.consume(records.size());
+            }
+            std::cout << out;
+
+            if (count_only) {
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                std::cout << count << " results in " << elapsed.count() << "s\n";
+            }
+        } catch (const std::runtime_error& ex) {
+            std::cerr << ex.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    try {
+        FrameReader reader(input);
+        if (index) {
+            std::cout << "frame,first_id,offset,raw_size,size\n";
+            for (size_t frame = 0; frame < reader.index().size(); ++frame) {
+                const IndexEntry& entry = reader.index()[frame];
+                std::cout << frame << "," << entry.first_id << "," << entry.offset << "," << entry.raw_size << ","
+                          << entry.size << "\n";
+            }
+            return 0;
+        }
+
+        if (reader.index().empty()) {
+            return 0;
+        }
+
+        std::string out;
+        reader.read(0, out);
+        for (size_t frame = reader.index().size() > 1 ? reader.find(from_id) : 1; frame < reader.index().size(); ++frame) {
+            reader.read(frame, out);
+            std::cout << out;
+            out.clear();
+        }
+        std::cout << out;
+    } catch (const std::runtime_error& ex) {
+        std::cerr << ex.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//
+// One simulation's result, laid out the same way for every process reading the ring.
+//
+struct ResultRecord {
+    // Simulation id, counting through the schedules in order, and which schedule (sweep line) it's from.
+    uint64_t id = 0;
+    uint32_t schedule = 0;
+    uint32_t bankrupt = 0;
+
+    // Start offset (as a fraction of the market data), final value, and value at retirement (NaN if never retired).
+    double start = 0.0;
+    double final = 0.0;
+    double retirement = 0.0;
+};
+static_assert(sizeof(ResultRecord) == 40);
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Ring positions are shared between processes");
+
+//
+// Results published through a POSIX shared memory ring buffer (under /dev/shm), so a process on the same machine can
+// read records straight out of the simulator's memory rather than parsing text through a pipe. The segment is a
+// RingHeader followed by capacity records, record i living in slot i % capacity.
+//
+// Any number of threads in the simulator can publish, but there is a single reader. The simulator waits for the
+// reader when the ring is full, so nothing is dropped (and nothing is published until a reader keeps up).
+//
+// Each side records its pid in the header and, while waiting on the other, checks every so often that it's still
+// running, so neither waits forever on a process which died. Whichever side is left removes the shared memory.
+//
+namespace shm_ring {
+
+constexpr uint32_t MAGIC = 0x4e52534c;  // "LSRN"
+
+struct RingHeader {
+    // Set last by the writer, once everything else is.
+    std::atomic<uint32_t> magic{0};
+    uint32_t record_size = sizeof(ResultRecord);
+    uint64_t capacity = 0;
+
+    // The processes on either end, the reader's 0 until one attaches.
+    int32_t writer_pid = 0;
+    std::atomic<int32_t> reader_pid{0};
+
+    // Each on its own cache line, so the writer and reader aren't fighting over one.
+    alignas(64) std::atomic<uint64_t> written{0};
+    alignas(64) std::atomic<uint64_t> read{0};
+    alignas(64) std::atomic<uint32_t> closed{0};
+};
+
+inline size_t segment_size(size_t capacity) { return sizeof(RingHeader) + capacity * sizeof(ResultRecord); }
+
+inline ResultRecord* records(void* segment) {
+    return reinterpret_cast<ResultRecord*>(static_cast<char*>(segment) + sizeof(RingHeader));
+}
+
+// Shared memory names are a single path component, with a leading slash.
+inline std::string segment_name(const std::string& name) { return name.starts_with("/") ? name : "/" + name; }
+
+// How often a side waiting on the other checks it's still there.
+constexpr std::chrono::milliseconds LIVENESS_INTERVAL{100};
+
+// If the process is still running (signal 0 only checks it could be sent one).
+inline bool alive(int32_t pid) { return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH); }
+
+}  // namespace shm_ring
+
+class ShmRingWriter {
+public:
+    // Replaces any existing ring with the name. The capacity is rounded up to a power of two. Publishing fails if no
+    // reader has attached within the timeout once the ring is full.
+    ShmRingWriter(const std::string& name,
+                  size_t capacity,
+                  std::chrono::duration<double> timeout = std::chrono::seconds(10))
+        : name_(shm_ring::segment_name(name)),
+          timeout_(std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout)) {
+        capacity_ = std::bit_ceil(std::max<size_t>(capacity, 2));
+        size_ = shm_ring::segment_size(capacity_);
+
+        shm_unlink(name_.c_str());
+        fd_ = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd_ == -1 || ftruncate(fd_, size_) != 0) {
+            throw std::runtime_error("Unable to create shared memory '" + name_ + "'");
+        }
+        void* segment = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (segment == MAP_FAILED) {
+            throw std::runtime_error("Unable to map shared memory '" + name_ + "'");
+        }
+
+        header_ = new (segment) shm_ring::RingHeader();
+        header_->capacity = capacity_;
+        header_->writer_pid = getpid();
+        records_ = shm_ring::records(segment);
+        header_->magic.store(shm_ring::MAGIC, std::memory_order_release);
+    }
+    ~ShmRingWriter() {
+        close();
+        // Nothing will read what's left once the reader is gone.
+        if (failed_ || (header_ && header_->reader_pid != 0 && !shm_ring::alive(header_->reader_pid))) {
+            shm_unlink(name_.c_str());
+        }
+        if (header_) munmap(header_, size_);
+        if (fd_ != -1) ::close(fd_);
+    }
+
+    ShmRingWriter(const ShmRingWriter&) = delete;
+    ShmRingWriter& operator=(const ShmRingWriter&) = delete;
+
+public:
+    //
+    // Publishes count records, calling fill(i, record) to write each one in place in the ring. Threads publishing at
+    // the same time each get their own slots, but the records only become visible to the reader in the order the
+    // slots were handed out. Throws if the reader died or never attached, after which every publish throws.
+    //
+    template <typename Fill>
+    void publish(size_t count, const Fill& fill) {
+        const size_t chunk = capacity_ / 2;
+        for (size_t done = 0; done < count; done += chunk) {
+            const size_t size = std::min(chunk, count - done);
+            const uint64_t first = reserved_.fetch_add(size);
+
+            // Wait for the reader to free up the slots.
+            Liveness liveness;
+            while (first + size - header_->read.load(std::memory_order_acquire) > capacity_) {
+                if (liveness.due()) {
+                    check_reader(liveness);
+                }
+                std::this_thread::yield();
+            }
+            for (size_t i = 0; i < size; ++i) {
+                fill(done + i, records_[(first + i) & (capacity_ - 1)]);
+            }
+
+            // Wait for the threads with earlier slots, then hand them all over to the reader. Those only hold things
+            // up if they're stuck on a reader which died, which they'll have said.
+            while (header_->written.load(std::memory_order_acquire) != first) {
+                if (failed_.load(std::memory_order_relaxed)) {
+                    throw std::runtime_error("The reader of shared memory '" + name_ + "' went away.");
+                }
+                std::this_thread::yield();
+            }
+            header_->written.store(first + size, std::memory_order_release);
+        }
+    }
+
+    // Tells the reader nothing else is coming.
+    void close() {
+        if (header_) header_->closed.store(1, std::memory_order_release);
+    }
+
+    size_t published() const { return header_->written.load(std::memory_order_acquire); }
+    bool failed() const { return failed_.load(std::memory_order_relaxed); }
+
+private:
+    // Tells a wait when it's time to look at the other side again, and how long it's been waiting.
+    struct Liveness {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point checked = start;
+
+        bool due() {
+            const auto now = std::chrono::steady_clock::now();
+            if (now - checked < shm_ring::LIVENESS_INTERVAL) {
+                return false;
+            }
+            checked = now;
+            return true;
+        }
+    };
+
+    void check_reader(const Liveness& liveness) {
+        const int32_t reader = header_->reader_pid.load(std::memory_order_acquire);
+        if (failed_.load(std::memory_order_relaxed)) {
+            throw std::runtime_error("The reader of shared memory '" + name_ + "' went away.");
+        }
+        if (reader == 0 && liveness.checked - liveness.start > timeout_) {
+            failed_ = true;
+            throw std::runtime_error("Nothing attached to read shared memory '" + name_ + "'.");
+        }
+        if (reader != 0 && !shm_ring::alive(reader)) {
+            failed_ = true;
+            throw std::runtime_error("The reader of shared memory '" + name_ + "' went away.");
+        }
+    }
+
+private:
+    const std::string name_;
+    const std::chrono::steady_clock::duration timeout_;
+    size_t capacity_ = 0;
+    size_t size_ = 0;
+
+    int fd_ = -1;
+    shm_ring::RingHeader* header_ = nullptr;
+    ResultRecord* records_ = nullptr;
+
+    std::atomic<uint64_t> reserved_ = 0;
+    std::atomic<bool> failed_ = false;
+};
+
+//
+// Reads the records published by a ShmRingWriter. Records are read in place: next() returns those ready to read and
+// consume() hands their slots back to the writer once done with them. The shared memory is removed once everything
+// has been read, or once the writer is found to have died.
+//
+class ShmRingReader {
+public:
+    // Waits up to the timeout for the simulator to create the ring.
+    explicit ShmRingReader(const std::string& name, std::chrono::duration<double> timeout = std::chrono::seconds(10))
+        : name_(shm_ring::segment_name(name)) {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while ((fd_ = shm_open(name_.c_str(), O_RDWR, 0)) == -1) {
+            if (errno != ENOENT || std::chrono::steady_clock::now() > deadline) {
+                throw std::runtime_error("Unable to open shared memory '" + name_ + "'");
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // The writer sizes the segment just after creating it.
+        struct stat info;
+        while (fstat(fd_, &info) == 0 && static_cast<size_t>(info.st_size) < sizeof(shm_ring::RingHeader)) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                throw std::runtime_error("Shared memory '" + name_ + "' was never set up.");
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        size_ = info.st_size;
+        void* segment = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (segment == MAP_FAILED) {
+            throw std::runtime_error("Unable to map shared memory '" + name_ + "'");
+        }
+        header_ = static_cast<shm_ring::RingHeader*>(segment);
+        while (header_->magic.load(std::memory_order_acquire) != shm_ring::MAGIC) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                throw std::runtime_error("Shared memory '" + name_ + "' doesn't hold a result ring.");
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (header_->record_size != sizeof(ResultRecord) ||
+            shm_ring::segment_size(header_->capacity) != size_) {
+            throw std::runtime_error("Shared memory '" + name_ + "' doesn't hold a result ring.");
+        }
+        capacity_ = header_->capacity;
+        records_ = shm_ring::records(segment);
+        read_ = header_->read.load(std::memory_order_relaxed);
+        header_->reader_pid.store(getpid(), std::memory_order_release);
+    }
+    ~ShmRingReader() {
+        if (finished() || writer_died_) shm_unlink(name_.c_str());
+        if (header_) munmap(header_, size_);
+        if (fd_ != -1) ::close(fd_);
+    }
+
+    ShmRingReader(const ShmRingReader&) = delete;
+    ShmRingReader& operator=(const ShmRingReader&) = delete;
+
+public:
+    // Records ready to be read (stopping at the end of the ring, the rest follow once these are consumed). Empty if
+    // the writer hasn't published anything new yet.
+    std::span<const ResultRecord> next() const {
+        const uint64_t written = header_->written.load(std::memory_order_acquire);
+        const size_t slot = read_ & (capacity_ - 1);
+        return {records_ + slot, std::min<size_t>(written - read_, capacity_ - slot)};
+    }
+
+    // Like next(), but waits for records, only returning empty once the writer is finished. Throws if the writer
+    // died before finishing.
+    std::span<const ResultRecord> wait() {
+        auto checked = std::chrono::steady_clock::now();
+        while (true) {
+            // Check closed first, anything published before closing is visible once it's set.
+            const bool closed = header_->closed.load(std::memory_order_acquire);
+            if (auto records = next(); !records.empty() || closed) {
+                return records;
+            }
+            if (const auto now = std::chrono::steady_clock::now(); now - checked >= shm_ring::LIVENESS_INTERVAL) {
+                checked = now;
+                if (!shm_ring::alive(header_->writer_pid) && !header_->closed.load(std::memory_order_acquire) &&
+                    next().empty()) {
+                    writer_died_ = true;
+                    throw std::runtime_error("The simulator writing shared memory '" + name_ + "' died.");
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    // Hands the first count records from next() back to the writer.
+    void consume(size_t count) {
+        read_ += count;
+        header_->read.store(read_, std::memory_order_release);
+    }
+
+    bool finished() const {
+        return header_ && header_->closed.load(std::memory_order_acquire) &&
+            header_->written.load(std::memory_order_acquire) == read_;
+    }
+
+private:
+    const std::string name_;
+    size_t capacity_ = 0;
+    size_t size_ = 0;
+
+    int fd_ = -1;
+    shm_ring::RingHeader* header_ = nullptr;
+    const ResultRecord* records_ = nullptr;
+
+    uint64_t read_ = 0;
+    bool writer_died_ = false;
+};
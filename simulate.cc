@@ -1,14 +1,30 @@
 #include "args.hh"
-
+#include "batch.hh"
+#include "cost_basis.hh"
+#include "difftest.hh"
+#include "estimate.hh"
+#include "events.hh"
+#include "inflation.hh"
+#include "loan.hh"
+#include "market_data.hh"
+#include "stress.hh"
+#include "sweep.hh"
+#include "perf.hh"
+#include "policy.hh"
+#include "validate.hh"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
 #include <random>
 #include <iostream>
 #include <iomanip>
+#include <memory>
 #include <set>
-
-#include <sys/mman.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/stat.h>
+#include <sstream>
+#include <string_view>
+#include <vector>
 
 class ModelBase {
 public:
@@ -26,6 +42,11 @@ public:
             .description="How long to run this model for (optional).",
             .value = std::numeric_limits<double>::infinity()
         });
+        parser.add_argument(arg_name("indexed"), {
+            .callback=[this](const auto& p){ indexed_ = std::get<bool>(p); },
+            .description="Index the dollar amounts (a fund's contribution limit) to --cpi, they're then in today's dollars.",
+            .is_flag = true
+        });
     }
     virtual ~ModelBase() = default;
 
@@ -39,6 +60,16 @@ public:
     const auto end() const { return start() + duration_; }
     void set_start(double start) { start_ = start; }
 
+    bool indexed() const { return indexed_; }
+    void set_inflation(const Inflation* inflation) { inflation_ = inflation; }
+
+    //
+    // Models with random events (see EventRng) draw all of a simulation's up front, before it's stepped through. They
+    // only depend on the seed and simulation, so the same simulation sees the same events on every run.
+    //
+    virtual bool stochastic() const { return false; }
+    virtual void sample_events(uint64_t seed, size_t simulation, bool antithetic, double years) {}
+
     virtual double update_to(double year) {
         double dt = year - set_year(year);
 
@@ -59,6 +90,11 @@ protected:
     virtual double update(double dt) { return 0.0; }
     double set_year(double year) { double prev = year_; year_ = year; return prev; }
 
+    // An amount in today's dollars in the dollars of the current year, when indexed.
+    double to_nominal(double amount) const {
+        return indexed_ && inflation_ ? amount * (*inflation_)(year_) : amount;
+    }
+
 private:
     const std::string name_;
 
@@ -66,6 +102,9 @@ private:
     double duration_ = 0.0;
 
     double year_ = 0.0;
+
+    bool indexed_ = false;
+    const Inflation* inflation_ = nullptr;
 };
 
 class FundBase : public ModelBase {
@@ -82,10 +121,25 @@ public:
             .description="Annual contribution limit.",
             .value=0.0
         });
+        parser.add_argument(arg_name("account"), {
+            .callback=[this](const auto& p){ account_ = std::get<std::string>(p); },
+            .description="How withdrawals are taxed with --taxes (taxable, pretax or roth).",
+            .value=account_
+        });
+        parser.add_argument(arg_name("basis"), {
+            .callback=[this](const auto& p){ basis_ = CostBasis(parse_basis_method(std::get<std::string>(p))); },
+            .description="How the cost of what's sold is found for realized gains (average or fifo).",
+            .value=std::string("average")
+        });
     }
     ~FundBase() override = default;
 
     const double amount() const { return amount_; }
+    const std::string& account() const { return account_; }
+    BasisMethod basis_method() const { return basis_.method(); }
+
+    // Gains (or losses) realized by every sale so far, the starting amount counts as bought at the start.
+    double realized_gains() const { return realized_gains_; }
 
     double buy(double amount)  { 
         if (amount < 0.0) {
@@ -95,11 +149,12 @@ public:
         if (contribution_limit_ > 0.0) {
             double& contributed = contributed_[std::floor(year())];
 
-            const double remaining = contribution_limit_ - contributed;
+            const double remaining = to_nominal(contribution_limit_) - contributed;
             amount = std::min(amount, remaining);
             contributed += amount;
         }
 
+        opened_basis().buy(amount, year());
         amount_ += amount;
         return amount;
     }
@@ -113,31 +168,62 @@ public:
         }
 
         if (amount_ >= amount) {
+            realized_gains_ += amount - opened_basis().sell(amount, amount_);
             amount_ -= amount;
             return amount;
         }
 
         const double removed = amount_;
+        realized_gains_ += removed - opened_basis().sell(removed, amount_);
         amount_ = 0;
         return removed;
     }
 
     double update_to(double year) override {
+        // The starting amount is bought before it grows, so the growth is a gain.
+        CostBasis& basis = opened_basis();
+
         double dt = year - set_year(year);
-        amount_ = update_amount(amount_, dt);
+        amount_ = update_amount(amount_, year, dt);
+        if (basis.indexed()) {
+            basis.set_index(update_amount(basis.index(), year, dt));
+        }
         return amount_;
     }
 
     virtual void set_offset_percent(double percent) {}
 
+    // Market data backing this fund, if the growth depends on the simulation offset.
+    virtual const MarketData* market_data() const { return nullptr; }
+
+    // Growth factor of a fund updated to the given year after dt (only meaningful when there is no market data).
+    double growth(double year, double dt) const { return update_amount(1.0, year, dt); }
+
 protected:
-    virtual double update_amount(double amount, double dt) const = 0;
+    virtual double update_amount(double amount, double year, double dt) const = 0;
+
+private:
+    // The basis, with the starting amount bought before anything else happens (it can't be when parsing, as the
+    // amount and method can come in either order).
+    CostBasis& opened_basis() {
+        if (!basis_opened_) {
+            basis_.buy(amount_, year());
+            basis_opened_ = true;
+        }
+        return basis_;
+    }
 
 private:
     std::map<size_t, double> contributed_;
 
     double contribution_limit_ = 0.0;
     double amount_ = 0.0;
+
+    std::string account_ = "taxable";
+
+    CostBasis basis_;
+    bool basis_opened_ = false;
+    double realized_gains_ = 0.0;
 };
 
 class FixedRateFund final : public FundBase {
@@ -153,7 +239,7 @@ public:
     ModelBase::Ptr clone() const override { return std::make_unique<FixedRateFund>(*this); }
 
 protected:
-    double update_amount(double amount, double dt) const override {
+    double update_amount(double amount, double year, double dt) const override {
         return amount * std::exp(rate_ * dt);
     }
 
@@ -165,77 +251,38 @@ class MarketFund final : public FundBase {
 public:
     MarketFund(std::string name, ArgumentParser& parser) : FundBase(std::move(name), parser) {
         if (file_ == nullptr) {
-            file_ = std::make_shared<FileData>();
-
-            // Memory map the market fund file
-            file_->fd = open("market_data.bin", O_RDONLY);
-            if (file_->fd == -1) {
-                throw std::runtime_error("Failed to open market_data.bin");
-            }
-
-            struct stat file_stat;
-            if (fstat(file_->fd, &file_stat) == -1) {
-                throw std::runtime_error("Failed to get file stat");
-            }
-
-            void* map = mmap(0, file_stat.st_size, PROT_READ, MAP_SHARED, file_->fd, 0);
-            if (map == MAP_FAILED) {
-                throw std::runtime_error("Failed to map file");
-            }
-
-            file_->data = static_cast<float*>(map);
-            file_->data_size = file_stat.st_size / sizeof(float);
+            file_ = std::make_shared<MarketData>("market_data.bin");
         }
-        wrap_around_multiplier_ = file_->data[file_->data_size - 1] / file_->data[0];
     }
 
     ~MarketFund() override = default;
 
-    size_t data_size() const { return file_->data_size; }
+    size_t data_size() const { return file_->size(); }
+    const MarketData* market_data() const override { return file_.get(); }
+
+    // Switch every market fund over to the compressed market data.
+    static void compress() { file_ = MarketData::compress(*file_); }
 
     void set_offset_percent(double percent) override { day_offset_ = percent * data_size(); }
     ModelBase::Ptr clone() const override { return std::make_unique<MarketFund>(*this); }
 
 protected:
-    double update_amount(double amount, double dt) const override {
-        return lookup(year() + dt) * amount / lookup(year());
+    double update_amount(double amount, double year, double dt) const override {
+        return lookup(year + dt) * amount / lookup(year);
     }
 
 private:
     double lookup(double year) const {
-        double day = year * 365.25 + day_offset_;
-        size_t before = std::floor(day);
-
-        // Easy case, within the orignal data
-        if (before < file_->data_size) {
-            return file_->data[before];
-        }
-
-        if (before >= 2 * file_->data_size) {
-            throw std::runtime_error("Invalid after index.");
-        }
-
-        return wrap_around_multiplier_ * file_->data[before % file_->data_size];
+        return file_->lookup(year * 365.25 + day_offset_);
     }
 
 private:
-    struct FileData {
-        int fd;
-        float* data;
-        size_t data_size;
-
-        ~FileData() {
-            if (data) munmap(data, data_size * sizeof(double));
-            close(fd);
-        }
-    };
-    static std::shared_ptr<FileData> file_;
+    static MarketData::Ptr file_;
 
-    double wrap_around_multiplier_ = 0.0;
     double day_offset_ = 0;
 };
 
-std::shared_ptr<MarketFund::FileData> MarketFund::file_;
+MarketData::Ptr MarketFund::file_;
 
 class Job final : public ModelBase {
 public:
@@ -249,10 +296,32 @@ public:
             .description="The annual percent rate of return.",
             .value = 0.0,
         });
+        parser.add_argument(arg_name("layoff-rate"), {
+            .callback=[this](const auto& p){ layoff_rate_ = std::get<double>(p); },
+            .description="Chance per year of losing the job, which then pays nothing for a spell (optional).",
+            .value = 0.0
+        });
+        parser.add_argument(arg_name("layoff-years"), {
+            .callback=[this](const auto& p){ layoff_years_ = std::get<double>(p); },
+            .description="Average length of a spell out of work in years.",
+            .value = layoff_years_
+        });
     }
     ~Job() override = default;
 
     ModelBase::Ptr clone() const override { return std::make_unique<Job>(*this); }
+
+    bool stochastic() const override { return layoff_rate_ > 0.0; }
+    void sample_events(uint64_t seed, size_t simulation, bool antithetic, double years) override {
+        EventRng arrivals(seed, simulation, name() + "/arrival", antithetic);
+        EventRng durations(seed, simulation, name() + "/duration", antithetic);
+        spells_ = EventCursor(
+            poisson_events(arrivals, durations, start(), std::min(end(), years), layoff_rate_, layoff_years_));
+    }
+
+    // Out of work for the whole of the current step, so no salary doesn't mean retired.
+    bool laid_off() const { return spells_.active(year()); }
+
 protected:
     double update(double dt) override {
         double previous = year() - dt;
@@ -260,12 +329,19 @@ protected:
             salary_ *= std::exp(rate_);
         }
 
-        return dt * salary_;
+        if (!spells_.empty()) {
+            return to_nominal(std::max(dt - spells_.covered(previous, year()), 0.0) * salary_);
+        }
+        return to_nominal(dt * salary_);
     }
 
 private:
     double salary_ = 0.0;
     double rate_ = 0.0;
+
+    double layoff_rate_ = 0.0;
+    double layoff_years_ = 0.5;
+    EventCursor spells_;
 };
 
 class Spending final : public ModelBase {
@@ -285,9 +361,42 @@ public:
             .description="Is the model expoential (as opposed to linear).",
             .is_flag = true,
         });
+        parser.add_argument(arg_name("rule"), {
+            .callback=[this](const auto& p){ policy_.spending = parse_spending(std::get<std::string>(p)); },
+            .description="How spending reacts to the portfolio once retired (fixed, guardrail or percent).",
+            .value = std::string("fixed")
+        });
+        parser.add_argument(arg_name("withdrawal-rate"), {
+            .callback=[this](const auto& p){ policy_.rate = std::get<double>(p); },
+            .description="Share of the portfolio spent each year with percent, or kept around with guardrail.",
+            .value = policy_.rate
+        });
+        parser.add_argument(arg_name("band"), {
+            .callback=[this](const auto& p){ policy_.band = std::get<double>(p); },
+            .description="How far the withdrawal rate can stray (as a fraction of it) before guardrails act.",
+            .value = policy_.band
+        });
+        parser.add_argument(arg_name("adjust"), {
+            .callback=[this](const auto& p){ policy_.adjust = std::get<double>(p); },
+            .description="Fraction guardrails cut or raise spending by.",
+            .value = policy_.adjust
+        });
+        parser.add_argument(arg_name("floor"), {
+            .callback=[this](const auto& p){ policy_.floor = std::get<double>(p); },
+            .description="Least spent with percent, as a multiple of the planned spending.",
+            .value = policy_.floor
+        });
+        parser.add_argument(arg_name("ceiling"), {
+            .callback=[this](const auto& p){ policy_.ceiling = std::get<double>(p); },
+            .description="Most spent with percent, as a multiple of the planned spending.",
+            .value = policy_.ceiling
+        });
     }
     ~Spending() override = default;
 
+    // How the planned spending changes with the portfolio, which the engines apply (see Policy).
+    const Policy& policy() const { return policy_; }
+
     ModelBase::Ptr clone() const override { return std::make_unique<Spending>(*this); }
 protected:
     double update(double dt) override {
@@ -297,7 +406,7 @@ protected:
             annual_ *= std::exp(rate_ * dt);
         }
 
-        return dt * annual_;
+        return to_nominal(dt * annual_);
     }
 
 private:
@@ -305,6 +414,8 @@ private:
     double rate_ = 0.0;
 
     bool linear_ = true;
+
+    Policy policy_;
 };
 
 class Cost final : public ModelBase {
@@ -324,6 +435,16 @@ public:
             .description="Cost to close, on the end of this cost.",
             .value = 0.0
         });
+        parser.add_argument(arg_name("rate"), {
+            .callback=[this](const auto& p){ rate_ = std::get<double>(p); },
+            .description="Annual interest rate, which finances everything but the down payment as a loan over the duration.",
+            .value = 0.0
+        });
+        parser.add_argument(arg_name("prepay"), {
+            .callback=[this](const auto& p){ prepay_ = std::get<double>(p); },
+            .description="Paid on the loan each year on top of the scheduled payments, to pay it off early.",
+            .value = 0.0
+        });
     }
     ~Cost() override = default;
 
@@ -332,11 +453,14 @@ public:
         if (year < start()) {
             return 0.0;
         }
+        if (rate_ > 0.0 || prepay_ > 0.0) {
+            return update_loan(year, dt);
+        }
         if (year > end()) {
             double amount = remaining_ + close_;
             remaining_ = 0;
             close_ = 0;
-            return amount;
+            return to_nominal(amount);
         }
 
         if (down_ > 0.0) {
@@ -344,23 +468,103 @@ public:
             remaining_ -= down_;
             double amount = down_;
             down_ = 0.0;
-            return amount;
+            return to_nominal(amount);
         }
 
         double amount = dt * total_ / (end() - start());
         amount = std::min(remaining_, amount);
         remaining_ -= amount;
 
-        return amount;
+        return to_nominal(amount);
     }
 
     ModelBase::Ptr clone() const override { return std::make_unique<Cost>(*this); }
 
+private:
+    //
+    // Financed, the down payment is made on the first step and the rest is a Loan paid over the duration, so each step
+    // pays exactly what's due over its own interval (however long that is). Whatever is still owed at the end (only
+    // with an infinite duration or rounding) is paid off with the closing cost.
+    //
+    // When indexed, the price (and prepayment) are in the dollars of the start, the loan's payments being fixed from
+    // there on. Only the closing cost follows inflation to the end. Returns nominal dollars.
+    //
+    double update_loan(double year, double dt) {
+        double amount = 0.0;
+        if (!loan_) {
+            loan_ = Loan(to_nominal(total_ - down_), rate_, end() - start(), to_nominal(prepay_));
+            amount += to_nominal(down_);
+            down_ = 0.0;
+        }
+
+        const double from = std::max(year - dt, start()) - start();
+        const double to = std::min(year, end()) - start();
+        if (to > from) {
+            amount += loan_->paid(from, to);
+        }
+        if (year > end()) {
+            amount += loan_->balance(to) + to_nominal(close_);
+            *loan_ = Loan();
+            close_ = 0.0;
+        }
+        return amount;
+    }
+
 private:
     double total_ = 0.0;
     double remaining_ = 0.0;
     double down_ = 0.0;
     double close_ = 0.0;
+
+    double rate_ = 0.0;
+    double prepay_ = 0.0;
+    std::optional<Loan> loan_;
+};
+
+// Medical bills arriving at random, of a log normal cost.
+class Medical final : public ModelBase {
+public:
+    Medical(std::string name, ArgumentParser& parser) : ModelBase(std::move(name), parser) {
+        parser.add_argument(arg_name("rate"), {
+            .callback=[this](const auto& p){ rate_ = std::get<double>(p); },
+            .description="Average number of bills per year (optional).",
+            .value = 0.0
+        });
+        parser.add_argument(arg_name("cost"), {
+            .callback=[this](const auto& p){ cost_ = std::get<double>(p); },
+            .description="The median bill in dollars.",
+            .value = 0.0
+        });
+        parser.add_argument(arg_name("spread"), {
+            .callback=[this](const auto& p){ spread_ = std::get<double>(p); },
+            .description="Standard deviation of the log of a bill, how much larger than the median the worst ones are.",
+            .value = spread_
+        });
+    }
+    ~Medical() override = default;
+
+    ModelBase::Ptr clone() const override { return std::make_unique<Medical>(*this); }
+
+    bool stochastic() const override { return rate_ > 0.0 && cost_ > 0.0; }
+    void sample_events(uint64_t seed, size_t simulation, bool antithetic, double years) override {
+        EventRng arrivals(seed, simulation, name() + "/arrival", antithetic);
+        EventRng durations(seed, simulation, name() + "/duration", antithetic);
+        EventRng amounts(seed, simulation, name() + "/amount", antithetic);
+        std::vector<Event> bills = poisson_events(arrivals, durations, start(), std::min(end(), years), rate_, 0.0);
+        for (Event& bill : bills) {
+            bill.amount = amounts.lognormal(cost_, spread_);
+        }
+        bills_ = EventCursor(std::move(bills));
+    }
+
+protected:
+    double update(double dt) override { return to_nominal(bills_.arrived(year() - dt, year())); }
+
+private:
+    double rate_ = 0.0;
+    double cost_ = 0.0;
+    double spread_ = 1.0;
+    EventCursor bills_;
 };
 
 template <typename T>
@@ -391,6 +595,728 @@ std::vector<std::unique_ptr<T>> clone_vector(const std::vector<std::unique_ptr<T
     return output;
 }
 
+// Where each model (in the set's order) falls when sorted by name, the order --verbose prints them in. Sets of models
+// are ordered by address, which differs between clones.
+std::vector<size_t> name_order(const std::set<ModelBase::Ptr>& models) {
+    std::vector<size_t> order;
+    for (const auto& model : models) {
+        order.push_back(std::count_if(models.begin(), models.end(), [&](const auto& other) {
+            return other->name() < model->name();
+        }));
+    }
+    return order;
+}
+
+constexpr double PERIOD = 1 / 52.0;
+
+// The models making up a single scenario, each registers its arguments with the parser.
+struct Scenario {
+    explicit Scenario(ArgumentParser& parser) {
+        income_models.insert(std::make_unique<Job>("job", parser));
+
+        auto spending_model = std::make_unique<Spending>("spending", parser);
+        spending = spending_model.get();
+        expense_models.insert(std::move(spending_model));
+        expense_models.insert(std::make_unique<Cost>("child", parser));
+        expense_models.insert(std::make_unique<Cost>("child2", parser));
+        expense_models.insert(std::make_unique<Cost>("car", parser));
+        expense_models.insert(std::make_unique<Medical>("medical", parser));
+
+        market_models.push_back(std::make_unique<MarketFund>("market", parser));
+        market_models.push_back(std::make_unique<MarketFund>("retirement", parser));
+    }
+
+    std::set<ModelBase::Ptr> income_models;
+    std::set<ModelBase::Ptr> expense_models;
+
+    // In the order that funds will be contributed to  (reverse withdrawl order)
+    std::vector<FundBase::Ptr> market_models;
+
+    // The spending model (one of the expenses), whose spending the spending policy changes.
+    const Spending* spending = nullptr;
+
+    // Daily CPI (aligned with the market data) which indexed models follow, if any.
+    MarketData::Ptr cpi;
+
+    // Seeds the stochastic events, which each simulation draws from its own id. When antithetic, simulations 2k and
+    // 2k + 1 are a pair instead, drawing opposite events (see EventRng).
+    uint64_t seed = 42;
+    bool antithetic = false;
+
+    bool indexed() const {
+        auto any = [](const auto& models) {
+            return std::any_of(models.begin(), models.end(), [](const auto& model) { return model->indexed(); });
+        };
+        return any(income_models) || any(expense_models) || any(market_models);
+    }
+
+    bool stochastic() const {
+        auto any = [](const auto& models) {
+            return std::any_of(models.begin(), models.end(), [](const auto& model) { return model->stochastic(); });
+        };
+        return any(income_models) || any(expense_models);
+    }
+};
+
+//
+// Runs everything but the fund growth (which is the only part that depends on the market offset) once, so the
+// batched engines can share it between all of the simulations. When taxed, the tax on the salary is taken out of the
+// income here, pre-tax contributions coming off the taxable income from the step after they're made (as how much is
+// contributed depends on the income after tax).
+//
+Schedule build_schedule(const Scenario& base, double years, const std::optional<Taxes>& taxes = std::nullopt) {
+    std::set<ModelBase::Ptr> income_models = clone_set(base.income_models);
+    std::set<ModelBase::Ptr> expense_models = clone_set(base.expense_models);
+    std::vector<FundBase::Ptr> market_models = clone_vector(base.market_models);
+
+    Schedule schedule;
+    schedule.funds.resize(market_models.size());
+    for (size_t i = 0; i < market_models.size(); ++i) {
+        schedule.funds[i].amount = market_models[i]->amount();
+        schedule.funds[i].start = market_models[i]->start();
+        schedule.funds[i].market = market_models[i]->market_data();
+        schedule.funds[i].account = parse_account(market_models[i]->account());
+
+        // The batched engine keeps an average cost on each lane, the only basis it can tax.
+        if (taxes && market_models[i]->basis_method() != BasisMethod::AVERAGE) {
+            throw std::runtime_error("--taxes only supports the average cost basis, not --" +
+                                     market_models[i]->name() + "-basis fifo.");
+        }
+    }
+    schedule.taxes = taxes;
+    schedule.policy = base.spending->policy();
+
+    // Salary, pre-tax contributions and tax on them so far this tax year.
+    double taxed_income = 0.0;
+    double pretax = 0.0;
+    double income_tax = 0.0;
+
+    double previous = 0.0;
+    for (size_t i = 1; i < years / PERIOD; ++i) {
+        const double year = i * PERIOD;
+        const double dt = year - previous;
+        previous = year;
+
+        schedule.years.push_back(year);
+        schedule.ahead.push_back(year + dt);
+
+        double total_income = 0.0;
+        for (auto& income : income_models) {
+            total_income += income->update_to(year);
+        }
+        if (total_income == 0.0 && !schedule.retirement_step) {
+            schedule.retirement_step = schedule.steps() - 1;
+        }
+
+        double total_expenses = 0.0;
+        double planned = 0.0;
+        for (auto& expense : expense_models) {
+            const double this_expense = expense->update_to(year);
+            total_expenses += this_expense;
+            if (dynamic_cast<const Spending*>(expense.get())) {
+                planned += this_expense;
+            }
+        }
+        schedule.spending.push_back(planned);
+
+        const bool new_year = schedule.steps() == 1 || std::floor(year) != std::floor(year - dt);
+        schedule.new_year.push_back(new_year);
+        if (taxes) {
+            // Each step's tax takes off the pre-tax contributions so far, which are only made once it's paid. The
+            // next step makes up for one's contributions, but for the last in a tax year the overpaid tax is refunded
+            // with the first step of the next.
+            double refund = 0.0;
+            if (new_year) {
+                refund = income_tax - (*taxes)(taxed_income - pretax, 0.0);
+                taxed_income = pretax = income_tax = 0.0;
+            }
+            taxed_income += total_income;
+            const double tax = (*taxes)(taxed_income - pretax, 0.0) - income_tax;
+            income_tax += tax;
+            total_income -= tax - refund;
+        }
+
+        // Contributions don't depend on the fund balances, only the sells do.
+        double to_invest = std::max(total_income - total_expenses, 0.0);
+        for (size_t i = 0; i < market_models.size(); ++i) {
+            size_t reverse_i = market_models.size() - 1 - i;
+            BatchFund& fund = schedule.funds[reverse_i];
+            if (!fund.market) {
+                fund.growth.push_back(market_models[reverse_i]->growth(year, dt));
+            }
+            market_models[reverse_i]->update_to(year);
+
+            double contributed = market_models[reverse_i]->buy(to_invest);
+            to_invest -= contributed;
+            fund.contributed.push_back(contributed);
+            if (fund.account == Account::PRETAX) {
+                pretax += contributed;
+            }
+        }
+
+        // The year's taxed salary so far, less this step's pre-tax contributions too.
+        if (taxes) {
+            schedule.taxed_income.push_back(taxed_income - pretax);
+        }
+
+        schedule.to_spend.push_back(std::max(total_expenses - total_income, 0.0));
+    }
+
+    return schedule;
+}
+
+// Market data of the first market backed fund, which is what the historical start dates are chosen from.
+const MarketData* first_market(const std::vector<FundBase::Ptr>& market_models) {
+    for (const auto& fund : market_models) {
+        if (const MarketData* market = fund->market_data()) {
+            return market;
+        }
+    }
+    return nullptr;
+}
+
+// Everything the reference engine did on one step, what --verbose prints.
+struct ReferenceStep {
+    double year = 0.0;
+
+    // For each model, by name.
+    std::vector<double> incomes;
+    std::vector<double> expenses;
+
+    // For each fund, in withdrawl order.
+    std::vector<double> contributed;
+    std::vector<double> spent;
+    std::vector<double> gains;
+    std::vector<double> amounts;
+
+    bool bankrupt = false;
+
+    // Prices relative to the start (1 without a CPI), to put the amounts in today's dollars.
+    double inflation = 1.0;
+};
+
+struct ReferenceResult {
+    double final = 0.0;
+    bool bankrupt = false;
+    std::optional<double> retirement;
+
+    // Prices relative to the start at the end and at retirement.
+    double inflation = 1.0;
+    double retirement_inflation = 1.0;
+};
+
+//
+// Runs one simulation by stepping (clones of) the models directly. This is the reference the batched engines are
+// checked against with --diff-test, so it's kept as simple as possible rather than fast. observe(step) is called
+// after every step.
+//
+template <typename Observe>
+ReferenceResult run_reference(const Scenario& base,
+                              double years,
+                              double percent,
+                              size_t simulation,
+                              const Observe& observe) {
+    // Clone the models so we can mutate them.
+    std::set<ModelBase::Ptr> income_models = clone_set(base.income_models);
+    std::set<ModelBase::Ptr> expense_models = clone_set(base.expense_models);
+    std::vector<FundBase::Ptr> market_models = clone_vector(base.market_models);
+
+    // Any random events for this simulation are drawn now, so stepping through it doesn't draw anything.
+    for (auto* models : {&income_models, &expense_models}) {
+        for (auto& model : *models) {
+            if (model->stochastic()) {
+                if (base.antithetic) {
+                    model->sample_events(base.seed, simulation / 2, simulation % 2 == 1, years);
+                } else {
+                    model->sample_events(base.seed, simulation, false, years);
+                }
+            }
+        }
+    }
+
+    for (auto& market : market_models) {
+        market->set_offset_percent(percent);
+    }
+
+    // Inflation at the same day offset as the market funds.
+    std::optional<Inflation> inflation;
+    if (base.cpi) {
+        const MarketData* market = first_market(base.market_models);
+        inflation.emplace(*base.cpi, percent * (market ? market->size() : base.cpi->size()), PERIOD, years);
+        for (auto* models : {&income_models, &expense_models}) {
+            for (auto& model : *models) {
+                model->set_inflation(&*inflation);
+            }
+        }
+        for (auto& market : market_models) {
+            market->set_inflation(&*inflation);
+        }
+    }
+
+    ReferenceResult result;
+    ReferenceStep step;
+    const std::vector<size_t> income_order = name_order(income_models);
+    const std::vector<size_t> expense_order = name_order(expense_models);
+    step.incomes.resize(income_models.size());
+    step.expenses.resize(expense_models.size());
+    step.contributed.resize(market_models.size());
+    step.spent.resize(market_models.size());
+    step.gains.resize(market_models.size());
+    step.amounts.resize(market_models.size());
+
+    // The spending policy, and its state for the year so far.
+    const Policy& policy = base.spending->policy();
+    const bool guardrail = policy.spending == Policy::Spending::GUARDRAIL;
+    double scale = 1.0;
+    double budget = 0.0;
+    double withdrawn = 0.0;
+
+    double previous = 0.0;
+    for (size_t i = 1; i < years / PERIOD; ++i) {
+        const double year = i * PERIOD;
+        const double dt = year - previous;
+        const bool new_year = i == 1 || std::floor(year) != std::floor(year - dt);
+        previous = year;
+        step.year = year;
+
+        // Compute total income, from all jobs.
+        double total_income = 0.0;
+        bool laid_off = false;
+        size_t m = 0;
+        for (auto& income : income_models) {
+            const double this_income = income->update_to(year);
+            total_income += this_income;
+            step.incomes[income_order[m++]] = this_income;
+            if (const Job* job = dynamic_cast<const Job*>(income.get())) {
+                laid_off |= job->laid_off();
+            }
+        }
+
+        // If we're out of job money, consider this retirment. This should probably update to use the job duration.
+        if (total_income == 0.0 && !laid_off && !result.retirement) {
+            for (auto& market : market_models) {
+                result.retirement = result.retirement.value_or(0.0) + market->amount();
+            }
+            result.retirement_inflation = inflation ? (*inflation)(year) : 1.0;
+        }
+
+        // Total expenses that need to be offset.
+        double total_expenses = 0.0;
+        double planned = 0.0;
+        m = 0;
+        for (auto& expense : expense_models) {
+            const double this_expense = expense->update_to(year);
+            total_expenses += this_expense;
+            step.expenses[expense_order[m++]] = this_expense;
+            if (dynamic_cast<const Spending*>(expense.get())) {
+                planned += this_expense;
+            }
+        }
+
+        // How much we can invest into market account and need to spend from market accounts
+        double to_invest = std::max(total_income - total_expenses, 0.0);
+        double to_spend = std::max(total_expenses - total_income, 0.0);
+        for (size_t i = 0; i < market_models.size(); ++i) {
+            size_t reverse_i = market_models.size() - 1 - i;
+            market_models[reverse_i]->update_to(year);
+
+            double contributed = market_models[reverse_i]->buy(to_invest);
+            to_invest -= contributed;
+            step.contributed[reverse_i] = contributed;
+        }
+
+        // Once grown and contributed to, the portfolio sets the spending for the year (see Policy).
+        if (!policy.fixed()) {
+            if (new_year) {
+                double total = 0.0;
+                for (auto& market : market_models) {
+                    total += market->amount();
+                }
+                if (guardrail) {
+                    scale *= policy.guardrail(withdrawn, total);
+                } else {
+                    budget = policy.rate * total;
+                }
+                withdrawn = 0.0;
+            }
+
+            if (result.retirement) {
+                const double spent = guardrail ? planned * scale : policy.percent(budget, dt, planned);
+                to_spend = Policy::withdrawal(to_spend, planned, spent);
+                withdrawn += spent;
+            }
+        }
+
+        for (size_t i = 0; i < market_models.size(); ++i) {
+            const double gains = market_models[i]->realized_gains();
+            double spend = market_models[i]->sell(to_spend);
+            to_spend -= spend;
+            step.spent[i] = spend;
+            step.gains[i] = market_models[i]->realized_gains() - gains;
+            step.amounts[i] = market_models[i]->amount();
+        }
+
+        // Bankrupt if we haven't covered the full set of expenses.
+        if (to_spend > 0.0) {
+            result.bankrupt = true;
+        }
+        step.bankrupt = result.bankrupt;
+        step.inflation = inflation ? (*inflation)(year) : 1.0;
+        result.inflation = step.inflation;
+
+        observe(step);
+    }
+
+    for (auto& market : market_models) {
+        result.final += market->amount();
+    }
+    return result;
+}
+
+struct Sweep {
+    std::vector<Schedule> schedules;
+
+    // Every argument set on any line of the sweep file (without the leading dashes), and the value each scenario
+    // ended up with (NaN if it isn't a number).
+    std::vector<std::string> parameters;
+    std::vector<std::vector<double>> values;
+};
+
+//
+// Reads a sweep file, which has one scenario per line given as arguments overriding the scenario arguments from the
+// command line (blank lines and lines starting with # are skipped).
+//
+Sweep load_sweep(const std::string& path,
+                int argc,
+                const char** argv,
+                double years,
+                const std::optional<Taxes>& taxes) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Unable to open sweep file " + path);
+    }
+
+    std::vector<std::string> lines;
+    std::vector<std::string> names;
+    for (std::string line; std::getline(file, line);) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        lines.push_back(line);
+
+        std::stringstream ss(line);
+        for (std::string arg; ss >> arg;) {
+            if (arg.starts_with("--") && std::find(names.begin(), names.end(), arg) == names.end()) {
+                names.push_back(arg);
+            }
+        }
+    }
+
+    Sweep sweep;
+    for (const auto& name : names) {
+        sweep.parameters.push_back(name.substr(2));
+    }
+
+    for (const auto& line : lines) {
+        ArgumentParser parser;
+        Scenario scenario(parser);
+
+        // Only the scenario's arguments from the command line, the rest are options for the whole run.
+        std::vector<std::string> args;
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            const bool has_value = i + 1 < argc && parser.has_argument(arg) && !parser.is_flag(arg);
+            if (parser.has_argument(arg) && arg != "--help") {
+                args.push_back(arg);
+                if (has_value) {
+                    args.push_back(argv[++i]);
+                }
+            }
+        }
+
+        std::stringstream ss(line);
+        for (std::string arg; ss >> arg;) {
+            args.push_back(arg);
+        }
+
+        parser.parse(args);
+        sweep.schedules.push_back(build_schedule(scenario, years, taxes));
+
+        auto& values = sweep.values.emplace_back();
+        for (const auto& name : names) {
+            const auto& value = parser.value(name);
+            const double* number = value ? std::get_if<double>(&*value) : nullptr;
+            values.push_back(number ? *number : std::numeric_limits<double>::quiet_NaN());
+        }
+    }
+    return sweep;
+}
+
+//
+// Reads a policies file, which has one withdrawal policy per line given as arguments (blank lines and lines starting
+// with # are skipped), for example:
+//
+//   --order retirement,market --spending guardrail --rate 0.045
+//
+std::vector<Policy> load_policies(const std::string& path, const Scenario& scenario) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Unable to open policies file " + path);
+    }
+
+    std::vector<Policy> policies;
+    for (std::string line; std::getline(file, line);) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        // Anything not given is the scenario's own policy.
+        Policy& policy = policies.emplace_back(scenario.spending->policy());
+        std::string order;
+        std::string spending;
+
+        ArgumentParser parser;
+        parser.add_argument("--order", {
+            .callback=[&order](const auto& p){ order = std::get<std::string>(p); },
+            .description = "funds to sell from, comma separated (all of them, in the order they're sold)",
+            .value = order
+        });
+        parser.add_argument("--spending", {
+            .callback=[&spending](const auto& p){ spending = std::get<std::string>(p); },
+            .description = "fixed, guardrail or percent",
+            .value = spending
+        });
+        parser.add_argument("--floor", {
+            .callback=[&policy](const auto& p){ policy.floor = std::get<double>(p); },
+            .description = "least percent spending spends, as a multiple of what was planned",
+            .value = policy.floor
+        });
+        parser.add_argument("--ceiling", {
+            .callback=[&policy](const auto& p){ policy.ceiling = std::get<double>(p); },
+            .description = "most percent spending spends, as a multiple of what was planned",
+            .value = policy.ceiling
+        });
+        parser.add_argument("--rate", {
+            .callback=[&policy](const auto& p){ policy.rate = std::get<double>(p); },
+            .description = "withdrawal rate for percent spending, and the one guardrails keep around",
+            .value = policy.rate
+        });
+        parser.add_argument("--band", {
+            .callback=[&policy](const auto& p){ policy.band = std::get<double>(p); },
+            .description = "how far (as a fraction of the rate) the withdrawal rate can stray before guardrails act",
+            .value = policy.band
+        });
+        parser.add_argument("--adjust", {
+            .callback=[&policy](const auto& p){ policy.adjust = std::get<double>(p); },
+            .description = "fraction guardrails cut or raise spending by",
+            .value = policy.adjust
+        });
+
+        std::vector<std::string> args;
+        std::stringstream ss(line);
+        for (std::string arg; ss >> arg;) {
+            args.push_back(arg);
+        }
+        parser.parse(args);
+
+        if (!spending.empty()) {
+            policy.spending = parse_spending(spending);
+        }
+        const auto& funds = scenario.market_models;
+        std::stringstream names(order);
+        for (std::string name; std::getline(names, name, ',');) {
+            auto it = std::find_if(funds.begin(), funds.end(), [&](const auto& fund) { return fund->name() == name; });
+            if (it == funds.end()) {
+                throw std::runtime_error("No fund named '" + name + "' to sell from in '" + line + "'.");
+            }
+            policy.order.push_back(it - funds.begin());
+        }
+
+        std::set<size_t> distinct(policy.order.begin(), policy.order.end());
+        if (!order.empty() && (distinct.size() != funds.size() || policy.order.size() != funds.size())) {
+            throw std::runtime_error("The sell order in '" + line + "' needs every fund exactly once.");
+        }
+    }
+
+    if (policies.empty()) {
+        throw std::runtime_error("No policies in " + path);
+    }
+    return policies;
+}
+
+template <typename Scalar>
+void print_results(const std::vector<double>& percents, const BatchResults<Scalar>& results) {
+    std::string out;
+    format_rows(percents.data(), results, "", out);
+    std::cout << out;
+}
+
+//
+// Differential test of the batched engines against the reference. Each trial draws a random scenario and offsets,
+// then checks every engine step by step (at a random lane of a random sized block) against the reference engine,
+// reporting the first step and field where each engine strays outside of its tolerance. Returns false if any did.
+//
+bool diff_test(std::ostream& os, size_t trials, size_t seed) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    auto index = [&](size_t count) { return std::min<size_t>(unit(rng) * count, count - 1); };
+
+    // The float32 and compressed market tolerances are about 10x the worst seen over many thousands of trials. Fixed
+    // point rounds every contribution and growth to the cent, which adds up to dollars (not a fraction of the balance)
+    // over 40 years of weekly steps.
+    std::vector<DiffReport> reports = {
+        {.engine = "batch", .tolerance = {.relative = 1e-12, .absolute = 1e-6}},
+        {.engine = "batch-tiled", .tolerance = {.relative = 1e-12, .absolute = 1e-6}},
+        {.engine = "batch-days", .tolerance = {.relative = 1e-12, .absolute = 1e-6}},
+        {.engine = "float32", .tolerance = {.relative = 2e-4, .absolute = 1.0, .exact_bankrupt = false}},
+        {.engine = "fixed-point", .tolerance = {.relative = 1e-6, .absolute = 50.0, .exact_bankrupt = false}},
+        {.engine = "compressed-market", .tolerance = {.relative = 2e-4, .absolute = 1.0, .exact_bankrupt = false}},
+    };
+    std::vector<std::vector<std::string>> failing_args(reports.size());
+    std::vector<double> failing_percents(reports.size());
+    auto add = [&](size_t e, size_t trial, const Trace& reference, const Trace& test,
+                   const std::vector<std::string>& args, const std::vector<std::string>& funds, double percent) {
+        const bool diverged = reports[e].first.has_value();
+        reports[e].add(trial, reference, test, funds);
+        if (!diverged && reports[e].first) {
+            failing_args[e] = args;
+            failing_percents[e] = percent;
+        }
+    };
+
+    std::map<const MarketData*, MarketData::Ptr> compressed;
+    for (size_t trial = 0; trial < trials; ++trial) {
+        ArgumentParser parser;
+        double years = 1.0;
+        parser.add_argument("--sim-years", {
+            .callback=[&years](const auto& p){ years = std::get<double>(p); },
+            .value = years
+        });
+        Scenario scenario(parser);
+        const std::vector<std::string> args = random_scenario(rng);
+        parser.parse(args);
+
+        // A second scenario over the same years, to run tiled with the first.
+        ArgumentParser other_parser;
+        Scenario other(other_parser);
+        std::vector<std::string> other_args = random_scenario(rng);
+        other_args.erase(other_args.begin(), other_args.begin() + 2);
+        other_parser.parse(other_args);
+
+        const Schedule schedule = build_schedule(scenario, years);
+        const Schedule other_schedule = build_schedule(other, years);
+
+        std::vector<std::string> funds;
+        for (const auto& fund : scenario.market_models) {
+            funds.push_back(fund->name());
+        }
+
+        // The offsets of a block, the simulation being checked is somewhere in it.
+        std::vector<double> percents(1 + index(2 * BatchEngine<double>::LANES));
+        for (double& percent : percents) {
+            percent = unit(rng);
+        }
+        const size_t checked = index(percents.size());
+        const double percent = percents[checked];
+
+        auto reference_trace = [&](double percent) {
+            Trace trace;
+            const ReferenceResult result = run_reference(scenario, years, percent, checked,
+                                                         [&](const ReferenceStep& step) {
+                trace.steps.push_back({.year = step.year, .amounts = step.amounts, .bankrupt = step.bankrupt});
+            });
+            trace.final = result.final;
+            trace.bankrupt = result.bankrupt;
+            trace.retirement = result.retirement.value_or(std::numeric_limits<double>::quiet_NaN());
+            return trace;
+        };
+        const Trace reference = reference_trace(percent);
+
+        auto engine_trace = [&]<typename Scalar>(const BatchEngine<Scalar>& engine, size_t s) {
+            Trace trace;
+            const auto results = engine.trace(percents, checked, s, [&](size_t i, const auto& amounts, bool bankrupt) {
+                trace.steps.push_back({.year = schedule.years[i], .amounts = amounts, .bankrupt = bankrupt});
+            });
+            trace.final = Money<Scalar>::to_dollars(results.final[checked]);
+            trace.retirement = Money<Scalar>::to_dollars(results.retirement[checked]);
+            trace.bankrupt = results.bankrupt[checked];
+            return trace;
+        };
+
+        Schedule compressed_schedule = schedule;
+        for (auto& fund : compressed_schedule.funds) {
+            if (fund.market) {
+                auto& data = compressed[fund.market];
+                if (!data) data = MarketData::compress(*fund.market);
+                fund.market = data.get();
+            }
+        }
+
+        const size_t tiled = index(2);
+        std::vector<const Schedule*> tile = {&other_schedule};
+        tile.insert(tile.begin() + tiled, &schedule);
+
+        std::vector<Trace> tests;
+        tests.push_back(engine_trace(BatchEngine<double>(schedule), 0));
+        tests.push_back(engine_trace(BatchEngine<double>(tile), tiled));
+
+        // Whole days are only run to the end, as the days engine can't be traced.
+        Trace days;
+        if (const MarketData* market = first_market(scenario.market_models)) {
+            const size_t count = percents.size();
+            const size_t stride = 1 + index(30);
+            const size_t first_day = index(market->size());
+            const size_t day = first_day + checked * stride;
+            const auto results = BatchEngine<double>(schedule).run_days(first_day, count, stride);
+            days.final = results.final[checked];
+            days.retirement = results.retirement[checked];
+            days.bankrupt = results.bankrupt[checked];
+
+            // The nearest offset which the reference puts on the same day (rounding can leave it just short).
+            double day_percent = static_cast<double>(day) / market->size();
+            while (day_percent * market->size() < day) {
+                day_percent = std::nextafter(day_percent, std::numeric_limits<double>::infinity());
+            }
+            Trace day_reference = reference_trace(day_percent);
+            day_reference.steps.clear();
+            add(2, trial, day_reference, days, args, funds, day_percent);
+        }
+
+        tests.push_back(engine_trace(BatchEngine<float>(schedule), 0));
+        tests.push_back(engine_trace(BatchEngine<Cents>(schedule), 0));
+        tests.push_back(engine_trace(BatchEngine<double>(compressed_schedule), 0));
+
+        for (size_t e = 0, t = 0; e < reports.size(); ++e) {
+            if (e == 2) {
+                continue;
+            }
+            add(e, trial, reference, tests[t++], args, funds, percent);
+        }
+    }
+
+    bool passed = true;
+    os << std::setprecision(6) << std::defaultfloat;
+    os << "engine,trials,steps,max_relative_error,bankrupt_flips,divergences\n";
+    for (const auto& report : reports) {
+        os << report.engine << "," << report.trials << "," << report.steps << "," << report.max_error << ","
+           << report.bankrupt_flips << "," << report.divergences << "\n";
+    }
+    for (size_t e = 0; e < reports.size(); ++e) {
+        const DiffReport& report = reports[e];
+        if (!report.first) {
+            continue;
+        }
+        passed = false;
+        const Divergence& divergence = *report.first;
+        os << report.engine << " first diverged on trial " << report.first_trial << " at step " << divergence.step
+           << " (year " << divergence.year << "), " << divergence.field << ": reference " << std::setprecision(17)
+           << divergence.reference << ", " << report.engine << " " << divergence.test << std::setprecision(6) << "\n";
+        os << "\t" << join_args(failing_args[e]) << " --sim-year-start " << std::setprecision(17)
+           << failing_percents[e] << std::setprecision(6) << "\n";
+    }
+    return passed;
+}
+
 int main(int argc, const char** argv) {
     std::cout << std::setprecision(2);
 
@@ -427,135 +1353,813 @@ int main(int argc, const char** argv) {
         .value=static_cast<double>(start)
     });
 
-    std::set<ModelBase::Ptr> base_income_models;
-    base_income_models.insert(std::make_unique<Job>("job", parser));
+    bool stress = false;
+    parser.add_argument("--stress", {
+        .callback=[&stress](const auto& p){ stress = std::get<bool>(p); },
+        .description = "run the worst historical start dates (and any --stress-windows) before the random offsets",
+        .is_flag=true
+    });
+    bool stress_only = false;
+    parser.add_argument("--stress-only", {
+        .callback=[&stress_only](const auto& p){ stress_only = std::get<bool>(p); },
+        .description = "only run the --stress start dates, skipping the random offsets",
+        .is_flag=true
+    });
+    size_t stress_count = 10;
+    parser.add_argument("--stress-count", {
+        .callback=[&stress_count](const auto& p){ stress_count = std::get<double>(p); },
+        .description = "how many of the worst historical start dates to stress test",
+        .value = static_cast<double>(stress_count)
+    });
+    double stress_years = 10.0;
+    parser.add_argument("--stress-years", {
+        .callback=[&stress_years](const auto& p){ stress_years = std::get<double>(p); },
+        .description = "window after each start date to find the largest market drawdown over",
+        .value = stress_years
+    });
+    std::string stress_windows;
+    parser.add_argument("--stress-windows", {
+        .callback=[&stress_windows](const auto& p){ stress_windows = std::get<std::string>(p); },
+        .description = "comma separated named crises (oil-crisis, black-monday, dotcom, financial-crisis, covid) or calendar years to stress test",
+        .value = stress_windows
+    });
+    bool screen_history = false;
+    parser.add_argument("--screen", {
+        .callback=[&screen_history](const auto& p){ screen_history = std::get<bool>(p); },
+        .description = "check if the plan survives every historical start date (harshest first, stopping at the first verdict)",
+        .is_flag=true
+    });
+    double failure_budget = 0.0;
+    parser.add_argument("--screen-failure-budget", {
+        .callback=[&failure_budget](const auto& p){ failure_budget = std::get<double>(p); },
+        .description = "fraction of start dates --screen allows to go bankrupt (0.01 checks the plan survives 99% of history)",
+        .value = failure_budget
+    });
+    bool importance = false;
+    parser.add_argument("--importance", {
+        .callback=[&importance](const auto& p){ importance = std::get<bool>(p); },
+        .description = "estimate the chance of going bankrupt from --sim-count start dates drawn favouring the harsh ones (found by a pilot run), weighted back to plain sampling",
+        .is_flag=true
+    });
+    size_t importance_pilot = 30;
+    parser.add_argument("--importance-pilot", {
+        .callback=[&importance_pilot](const auto& p){ importance_pilot = std::max(std::get<double>(p), 1.0); },
+        .description = "days between the start dates of the pilot run --importance finds the harsh start dates with",
+        .value = static_cast<double>(importance_pilot)
+    });
+    double importance_share = 0.02;
+    parser.add_argument("--importance-share", {
+        .callback=[&importance_share](const auto& p){ importance_share = std::get<double>(p); },
+        .description = "least share of the pilot's start dates --importance favours (the worst by final value)",
+        .value = importance_share
+    });
+    double importance_margin = 4.0;
+    parser.add_argument("--importance-margin", {
+        .callback=[&importance_margin](const auto& p){ importance_margin = std::get<double>(p); },
+        .description = "how many times as many of the pilot's start dates as went bankrupt --importance favours, to cover the near misses",
+        .value = importance_margin
+    });
+    double importance_mix = 0.1;
+    parser.add_argument("--importance-mix", {
+        .callback=[&importance_mix](const auto& p){ importance_mix = std::get<double>(p); },
+        .description = "share of --importance start dates drawn uniformly, which keeps every weight below 1 / share",
+        .value = importance_mix
+    });
+    bool variance_reduction = false;
+    parser.add_argument("--variance-reduction", {
+        .callback=[&variance_reduction](const auto& p){ variance_reduction = std::get<bool>(p); },
+        .description = "estimate the mean final value from --sim-count offsets with control variates (the market's growth at each offset) and, with stochastic events, antithetic pairs, reporting how much each cuts the variance",
+        .is_flag=true
+    });
+    bool exhaustive = false;
+    parser.add_argument("--exhaustive", {
+        .callback=[&exhaustive](const auto& p){ exhaustive = std::get<bool>(p); },
+        .description = "run every historical start date (every --exhaustive-stride days) rather than random offsets",
+        .is_flag=true
+    });
+    size_t exhaustive_stride = 1;
+    parser.add_argument("--exhaustive-stride", {
+        .callback=[&exhaustive_stride](const auto& p){ exhaustive_stride = std::max(std::get<double>(p), 1.0); },
+        .description = "days between start dates with --exhaustive",
+        .value = static_cast<double>(exhaustive_stride)
+    });
+    std::string sweep;
+    parser.add_argument("--sweep", {
+        .callback=[&sweep](const auto& p){ sweep = std::get<std::string>(p); },
+        .description = "file with one scenario per line (as arguments overriding the command line) to run at the same offsets",
+        .value = sweep
+    });
+    std::string cpi;
+    parser.add_argument("--cpi", {
+        .callback=[&cpi](const auto& p){ cpi = std::get<std::string>(p); },
+        .description = "daily CPI (floats, aligned day for day with market_data.bin) for --*-indexed models and --real (reference engine only)",
+        .value = cpi
+    });
+    bool real = false;
+    parser.add_argument("--real", {
+        .callback=[&real](const auto& p){ real = std::get<bool>(p); },
+        .description = "output in today's dollars, deflated by --cpi",
+        .is_flag=true
+    });
+    std::string policies;
+    parser.add_argument("--policies", {
+        .callback=[&policies](const auto& p){ policies = std::get<std::string>(p); },
+        .description = "file with one withdrawal policy per line to compare side by side on the same offsets (batched)",
+        .value = policies
+    });
+    size_t sweep_tile = 8;
+    parser.add_argument("--sweep-tile", {
+        .callback=[&sweep_tile](const auto& p){ sweep_tile = std::max(std::get<double>(p), 1.0); },
+        .description = "how many sweep scenarios to run together over each block of offsets",
+        .value = static_cast<double>(sweep_tile)
+    });
+    bool sweep_benchmark = false;
+    parser.add_argument("--sweep-benchmark", {
+        .callback=[&sweep_benchmark](const auto& p){ sweep_benchmark = std::get<bool>(p); },
+        .description = "compare the time and cache misses of the --sweep with and without tiling",
+        .is_flag=true
+    });
+    size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+    parser.add_argument("--threads", {
+        .callback=[&threads](const auto& p){ threads = std::max(std::get<double>(p), 1.0); },
+        .description = "how many threads to run the batched engine on",
+        .value = static_cast<double>(threads)
+    });
+    bool pin_threads = false;
+    parser.add_argument("--pin-threads", {
+        .callback=[&pin_threads](const auto& p){ pin_threads = std::get<bool>(p); },
+        .description = "pin the batched engine's threads to CPUs spread over the NUMA nodes, with the market data copied to each node",
+        .is_flag=true
+    });
+    size_t numa_nodes = 0;
+    parser.add_argument("--numa-nodes", {
+        .callback=[&numa_nodes](const auto& p){ numa_nodes = std::max(std::get<double>(p), 0.0); },
+        .description = "treat the CPUs as this many NUMA nodes rather than what the machine reports (0 uses the machine's)",
+        .value = static_cast<double>(numa_nodes)
+    });
+    bool topology_report = false;
+    parser.add_argument("--topology", {
+        .callback=[&topology_report](const auto& p){ topology_report = std::get<bool>(p); },
+        .description = "print the NUMA nodes and where each of the --threads would be pinned",
+        .is_flag=true
+    });
+    std::string kernel_cache;
+    parser.add_argument("--kernel-cache", {
+        .callback=[&kernel_cache](const auto& p){ kernel_cache = std::get<std::string>(p); },
+        .description = "run the batched engine on kernels generated for the scenario's shape, compiled (with $CXX) into this directory",
+        .value = kernel_cache
+    });
+    bool summary = false;
+    parser.add_argument("--summary", {
+        .callback=[&summary](const auto& p){ summary = std::get<bool>(p); },
+        .description = "print summary statistics for each scenario (on the batched engine) rather than every simulation",
+        .is_flag=true
+    });
+    bool writer_stats = false;
+    parser.add_argument("--writer-stats", {
+        .callback=[&writer_stats](const auto& p){ writer_stats = std::get<bool>(p); },
+        .description = "report (on stderr) how the batched engine's output writer thread kept up",
+        .is_flag=true
+    });
+    std::string compress;
+    parser.add_argument("--compress", {
+        .callback=[&compress](const auto& p){ compress = std::get<std::string>(p); },
+        .description = "compress the output (lz, zstd or auto) in independent frames followed by an index of simulation ids",
+        .value = compress
+    });
+    std::string shm_ring;
+    parser.add_argument("--shm-ring", {
+        .callback=[&shm_ring](const auto& p){ shm_ring = std::get<std::string>(p); },
+        .description = "publish binary results (from the batched engine) to a shared memory ring with this name rather than printing them",
+        .value = shm_ring
+    });
+    size_t shm_ring_capacity = 1 << 16;
+    parser.add_argument("--shm-ring-capacity", {
+        .callback=[&shm_ring_capacity](const auto& p){ shm_ring_capacity = std::max(std::get<double>(p), 2.0); },
+        .description = "how many results the --shm-ring holds (rounded up to a power of two)",
+        .value = static_cast<double>(shm_ring_capacity)
+    });
+    std::string store;
+    parser.add_argument("--store", {
+        .callback=[&store](const auto& p){ store = std::get<std::string>(p); },
+        .description = "write the results (from the batched engine) to a column store file for query_results rather than printing them",
+        .value = store
+    });
+    bool taxed = false;
+    parser.add_argument("--taxes", {
+        .callback=[&taxed](const auto& p){ taxed = std::get<bool>(p); },
+        .description = "pay income and capital gains tax (see --<fund>-account) on the batched engine",
+        .is_flag=true
+    });
+    std::string income_brackets = Taxes::INCOME_BRACKETS;
+    parser.add_argument("--tax-brackets", {
+        .callback=[&income_brackets](const auto& p){ income_brackets = std::get<std::string>(p); },
+        .description = "income tax brackets as threshold:rate pairs of taxable income",
+        .value = income_brackets
+    });
+    std::string gains_brackets = Taxes::GAINS_BRACKETS;
+    parser.add_argument("--tax-gains-brackets", {
+        .callback=[&gains_brackets](const auto& p){ gains_brackets = std::get<std::string>(p); },
+        .description = "capital gains tax brackets as threshold:rate pairs of taxable income (gains are stacked on top of income)",
+        .value = gains_brackets
+    });
+    double deduction = Taxes::DEDUCTION;
+    parser.add_argument("--tax-deduction", {
+        .callback=[&deduction](const auto& p){ deduction = std::get<double>(p); },
+        .description = "income which isn't taxed each year",
+        .value = deduction
+    });
+    bool batch = false;
+    parser.add_argument("--batch", {
+        .callback=[&batch](const auto& p){ batch = std::get<bool>(p); },
+        .description = "run the simulations together with the batched engine (ignored with --verbose)",
+        .is_flag=true
+    });
+    bool float32 = false;
+    parser.add_argument("--float32", {
+        .callback=[&float32](const auto& p){ float32 = std::get<bool>(p); },
+        .description = "use 32 bit floats for balances in the batched engine",
+        .is_flag=true
+    });
+    bool fixed_point = false;
+    parser.add_argument("--fixed-point", {
+        .callback=[&fixed_point](const auto& p){ fixed_point = std::get<bool>(p); },
+        .description = "use exact integer cents for balances in the batched engine",
+        .is_flag=true
+    });
+    bool check_float32 = false;
+    parser.add_argument("--check-float32", {
+        .callback=[&check_float32](const auto& p){ check_float32 = std::get<bool>(p); },
+        .description = "compare the float32 batched engine against double precision and report the differences",
+        .is_flag=true
+    });
+    bool check_fixed_point = false;
+    parser.add_argument("--check-fixed-point", {
+        .callback=[&check_fixed_point](const auto& p){ check_fixed_point = std::get<bool>(p); },
+        .description = "compare the fixed point batched engine against double precision and report the differences",
+        .is_flag=true
+    });
+    bool compressed_market = false;
+    parser.add_argument("--compressed-market", {
+        .callback=[&compressed_market](const auto& p){ compressed_market = std::get<bool>(p); },
+        .description = "keep the market data as 16 bit quantized price deltas rather than raw floats",
+        .is_flag=true
+    });
+    bool check_compressed = false;
+    parser.add_argument("--check-compressed", {
+        .callback=[&check_compressed](const auto& p){ check_compressed = std::get<bool>(p); },
+        .description = "compare simulations on the compressed market data against the raw data and report the differences",
+        .is_flag=true
+    });
+    size_t diff_trials = 0;
+    parser.add_argument("--diff-test", {
+        .callback=[&diff_trials](const auto& p){ diff_trials = std::max(std::get<double>(p), 0.0); },
+        .description = "check every batched engine step by step against the reference on this many random scenarios and offsets",
+        .value = static_cast<double>(diff_trials)
+    });
+    double max_disagreement = 0.01;
+    parser.add_argument("--check-max-disagreement", {
+        .callback=[&max_disagreement](const auto& p){ max_disagreement = std::get<double>(p); },
+        .description = "fraction of bankruptcy disagreements allowed before a --check-* comparison fails",
+        .value = max_disagreement
+    });
 
-    std::set<ModelBase::Ptr> base_expense_models;
-    base_expense_models.insert(std::make_unique<Spending>("spending", parser));
-    base_expense_models.insert(std::make_unique<Cost>("child", parser));
-    base_expense_models.insert(std::make_unique<Cost>("child2", parser));
-    base_expense_models.insert(std::make_unique<Cost>("car", parser));
+    // The differential test draws its own scenarios, so it's run before the scenario's (required) arguments are added.
+    if (std::find(argv + 1, argv + argc, std::string_view("--diff-test")) != argv + argc) {
+        parser.parse(argc, argv);
+        KernelCache::enable(kernel_cache);
+        return diff_test(std::cout, diff_trials, seed) ? 0 : 1;
+    }
 
-    // In the order that funds will be contributed to  (reverse withdrawl order)
-    std::vector<FundBase::Ptr> base_market_models;
-    base_market_models.push_back(std::make_unique<MarketFund>("market", parser));
-    base_market_models.push_back(std::make_unique<MarketFund>("retirement", parser));
+    Scenario base(parser);
 
     parser.parse(argc, argv);
 
-    std::mt19937 rng(seed);
+    Workers workers;
+    workers.threads = threads;
+    workers.pin = pin_threads;
+    workers.topology = Topology::detect();
+    if (numa_nodes > 0) {
+        workers.topology = workers.topology.split(numa_nodes);
+    }
+    KernelCache::enable(kernel_cache);
 
-    if (verbose) {
-        std::cout << "id,year,";
-        for (const auto& income : base_income_models) {
-            std::cout << income->name() << "_income,";
+    if (topology_report) {
+        workers.topology.report(std::cout, threads);
+        return 0;
+    }
+
+    Codec codec = Codec::NONE;
+    if (!compress.empty()) {
+        try {
+            codec = parse_codec(compress);
+        } catch (const std::runtime_error& ex) {
+            parser.help(ex.what());
+        }
+    }
+
+    std::optional<Taxes> taxes;
+    if (taxed) {
+        if (verbose) {
+            parser.help("--taxes needs the batched engine, which can't be --verbose.");
+        }
+        try {
+            taxes = Taxes{
+                .income = TaxTable::parse(income_brackets, deduction),
+                .gains = TaxTable::parse(gains_brackets, deduction)
+            };
+            for (const auto& fund : base.market_models) {
+                parse_account(fund->account());
+                if (fund->basis_method() != BasisMethod::AVERAGE) {
+                    throw std::runtime_error("--taxes only supports the average cost basis, not --" + fund->name() +
+                                             "-basis fifo.");
+                }
+            }
+        } catch (const std::runtime_error& ex) {
+            parser.help(ex.what());
         }
-        for (const auto& expense : base_expense_models) {
-            std::cout << expense->name() << "_expense,";
+    }
+
+    //
+    // Indexed cash flows follow the CPI at each simulation's offset, and stochastic events are drawn for each
+    // simulation, so unlike everything else they can't be worked out once for the batched engines to share.
+    //
+    // --verbose runs the reference engine instead of --batch and the like, but not instead of these.
+    const bool batched = !sweep.empty() || !policies.empty() || exhaustive || screen_history || check_compressed ||
+        check_float32 || check_fixed_point ||
+        (!verbose && (batch || taxed || float32 || fixed_point || summary || !shm_ring.empty() || !store.empty()));
+    base.seed = seed;
+    if (base.stochastic() && batched) {
+        parser.help("--job-layoff-rate and --medical-rate only run on the reference engine, which can't be batched.");
+    }
+    if (!cpi.empty()) {
+        if (batched) {
+            parser.help("--cpi only runs on the reference engine, which can't be batched.");
         }
-        for (const auto& market : base_market_models) {
-            std::cout << market->name() << "_contributed," << market->name() << "_spending," << market->name() << "_value,";
+        try {
+            base.cpi = std::make_shared<MarketData>(cpi);
+        } catch (const std::runtime_error& ex) {
+            parser.help(ex.what());
         }
-        std::cout << "bankrupt\n";
-    } else {
+        const MarketData* market = first_market(base.market_models);
+        if (market && market->size() != base.cpi->size()) {
+            parser.help("--cpi needs a price for every day of the market data.");
+        }
+    } else if (real || base.indexed()) {
+        parser.help("--real and --*-indexed need a --cpi series.");
+    }
+
+    if (screen_history) {
+        const MarketData* market = first_market(base.market_models);
+        if (!market) {
+            parser.help("--screen needs at least one market fund.");
+        }
+
+        const Schedule schedule = build_schedule(base, years, taxes);
+        const auto& order = harshest_order(*market, stress_years * 365.25);
+        const ScreenResult result = screen(schedule, *market, order, failure_budget);
+        std::cout << "verdict,evaluated,failures,total\n";
+        std::cout << (result.survives ? "survives" : "fails") << "," << result.evaluated << "," << result.failures
+            << "," << result.total << "\n";
+        return 0;
+    }
+
+    if (exhaustive) {
+        const MarketData* market = first_market(base.market_models);
+        if (!market) {
+            parser.help("--exhaustive needs at least one market fund.");
+        }
+
+        const size_t count = (market->size() + exhaustive_stride - 1) / exhaustive_stride;
+        std::vector<double> day_percents(count);
+        for (size_t i = 0; i < count; ++i) {
+            day_percents[i] = static_cast<double>(i * exhaustive_stride) / market->size();
+        }
+
+        const Schedule schedule = build_schedule(base, years, taxes);
         std::cout << "start,final,status,retirement_value\n";
+        if (float32) {
+            print_results(day_percents, BatchEngine<float>(schedule).run_days(0, count, exhaustive_stride));
+        } else if (fixed_point) {
+            print_results(day_percents, BatchEngine<Cents>(schedule).run_days(0, count, exhaustive_stride));
+        } else {
+            print_results(day_percents, BatchEngine<double>(schedule).run_days(0, count, exhaustive_stride));
+        }
+        return 0;
     }
 
-    for (size_t id = 0; id < sim_count; ++id) {
-        // Clone the models so we can mutate them.
-        std::set<ModelBase::Ptr> income_models = clone_set(base_income_models);
-        std::set<ModelBase::Ptr> expense_models = clone_set(base_expense_models);
-        std::vector<FundBase::Ptr> market_models = clone_vector(base_market_models);
+    //
+    // Start dates drawn favouring the harsh ones and weighted back (see ImportanceSampler), so a small chance of going
+    // bankrupt can be estimated from far fewer simulations. Stochastic events and indexed cash flows differ for each
+    // simulation, so those run on the reference engine.
+    //
+    if (importance) {
+        const MarketData* market = first_market(base.market_models);
+        if (!market) {
+            parser.help("--importance needs at least one market fund.");
+        }
 
-        // Set the offset percent for this simulation.
-        std::uniform_real_distribution<double> dist(0.0, 1.0);
-        const double percent = start > 0.0 ? start : dist(rng);
-        for (auto& market : market_models) {
-            market->set_offset_percent(percent);
+        // The pilot runs without any stochastic events or inflation, which only makes the favoured days less apt.
+        const Schedule schedule = build_schedule(base, years, taxes);
+        const size_t pilot_count = (market->size() + importance_pilot - 1) / importance_pilot;
+        const auto pilot = BatchEngine<double>(schedule).run_days(0, pilot_count, importance_pilot);
+
+        std::vector<double> percents;
+        std::vector<double> weights;
+        try {
+            const ImportanceSampler sampler(
+                favoured_days(pilot, importance_pilot, market->size(), importance_share, importance_margin),
+                importance_mix);
+            std::mt19937 rng(seed);
+            for (size_t id = 0; id < sim_count; ++id) {
+                const ImportanceSampler::Sample sample = sampler.draw(rng);
+                percents.push_back(sample.percent);
+                weights.push_back(sample.weight);
+            }
+        } catch (const std::runtime_error& ex) {
+            parser.help(ex.what());
         }
 
-        bool bankrupt = false;
-        std::optional<double> retirement_value;
+        std::vector<uint8_t> bankrupt;
+        if (base.stochastic() || base.cpi) {
+            for (size_t id = 0; id < percents.size(); ++id) {
+                bankrupt.push_back(run_reference(base, years, percents[id], id, [](const ReferenceStep&) {}).bankrupt);
+            }
+        } else {
+            bankrupt = BatchEngine<double>(schedule).run(percents).bankrupt;
+        }
+
+        const RuinEstimate estimate = estimate_ruin(weights, bankrupt);
+        std::cout << std::setprecision(6) << std::defaultfloat;
+        std::cout << "samples,ruins,probability,standard_error,effective_samples,variance_reduction\n";
+        std::cout << estimate.samples << "," << estimate.ruins << "," << estimate.probability << ","
+                  << estimate.standard_error << "," << estimate.effective_samples << "," << estimate.variance_reduction
+                  << "\n";
+        return 0;
+    }
+
+    //
+    // The mean final value estimated from the same simulations plainly, with antithetic pairs (when there are
+    // stochastic events) and with control variates on top. The controls are the market's growth over the whole run,
+    // up to retirement and over the --stress-years after it, which is most of what makes one offset end up with more
+    // than another.
+    //
+    if (variance_reduction) {
+        const MarketData* market = first_market(base.market_models);
+        if (!market) {
+            parser.help("--variance-reduction needs at least one market fund.");
+        }
+        const Schedule schedule = build_schedule(base, years, taxes);
+        if (schedule.steps() == 0) {
+            parser.help("--variance-reduction needs at least one step.");
+        }
 
-        constexpr double PERIOD = 1 / 52.0;
-        for (size_t i = 1; i < years / PERIOD; ++i) {
-            const double year = i * PERIOD;
+        // The pairs still start on independent dates, only their events are opposite.
+        base.antithetic = base.stochastic();
+        const size_t count = base.antithetic ? sim_count - sim_count % 2 : sim_count;
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<double> dist(0.0, 1.0);
+        std::vector<double> percents;
+        for (size_t id = 0; id < count; ++id) {
+            percents.push_back(start > 0.0 ? start : dist(rng));
+        }
 
-            if (verbose) {
-                std::cout << id << "," << std::setprecision(5) << year << "," << std::fixed;
+        std::vector<double> finals;
+        if (base.stochastic() || base.cpi) {
+            for (size_t id = 0; id < percents.size(); ++id) {
+                finals.push_back(run_reference(base, years, percents[id], id, [](const ReferenceStep&) {}).final);
             }
+        } else {
+            finals = BatchEngine<double>(schedule).run(percents).final;
+        }
 
-            // Compute total income, from all jobs.
-            double total_income = 0.0;
-            for (auto& income : income_models) {
-                const double this_income = income->update_to(year);
-                total_income += this_income;
+        const double end = schedule.ahead.back();
+        std::vector<GrowthControl> growths = {GrowthControl(*market, 0.0, end)};
+        if (schedule.retirement_step) {
+            const double retired = schedule.years[*schedule.retirement_step];
+            growths.emplace_back(*market, 0.0, retired);
+            growths.emplace_back(*market, retired, std::min(retired + stress_years, end));
+        }
 
-                if (verbose) {
-                    std::cout << this_income << ",";
+        // What the estimates are made from: each simulation, or each pair's average (controls included).
+        const size_t stride = base.antithetic ? 2 : 1;
+        std::vector<double> values;
+        std::vector<std::vector<double>> controls(growths.size());
+        std::vector<double> means;
+        for (size_t id = 0; id < finals.size(); id += stride) {
+            values.push_back(std::accumulate(finals.begin() + id, finals.begin() + id + stride, 0.0) / stride);
+            for (size_t c = 0; c < growths.size(); ++c) {
+                double control = 0.0;
+                for (size_t pair = id; pair < id + stride; ++pair) {
+                    control += growths[c](percents[pair]) / stride;
                 }
+                controls[c].push_back(control);
             }
+        }
+        for (const auto& growth : growths) {
+            means.push_back(growth.mean());
+        }
 
-            // If we're out of job money, consider this retirment. This should probably update to use the job duration.
-            if (total_income == 0.0 && !retirement_value) {
-                for (auto& market : market_models) {
-                    retirement_value = retirement_value.value_or(0.0) + market->amount();
+        const MeanEstimate plain = estimate_mean(finals);
+        auto print = [&](const std::string& method, MeanEstimate estimate) {
+            if (estimate.standard_error > 0.0) {
+                estimate.variance_reduction = std::pow(plain.standard_error / estimate.standard_error, 2);
+            }
+            std::cout << method << "," << estimate.samples << "," << std::fixed << std::setprecision(2)
+                      << estimate.mean << "," << estimate.standard_error << "," << std::defaultfloat
+                      << std::setprecision(6) << estimate.variance_reduction << "\n";
+        };
+        std::cout << "method,samples,mean_final,standard_error,variance_reduction\n";
+        print("plain", plain);
+        if (base.antithetic) {
+            print("antithetic", estimate_mean(values));
+        }
+        print("control-variates", estimate_with_controls(values, controls, means));
+        return 0;
+    }
+
+    // Set the offset percent for each simulation.
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    std::vector<double> percents;
+    if (stress || stress_only) {
+        if (const MarketData* market = first_market(base.market_models)) {
+            try {
+                const auto drawdowns = forward_drawdowns(*market, stress_years * 365.25);
+                const auto named = named_starts(stress_windows, *market);
+                for (size_t day : worst_starts(drawdowns, stress_count, 365, named)) {
+                    percents.push_back(static_cast<double>(day) / market->size());
                 }
+            } catch (const std::runtime_error& ex) {
+                parser.help(ex.what());
             }
+        }
+    }
+    if (!stress_only) {
+        for (size_t id = 0; id < sim_count; ++id) {
+            percents.push_back(start > 0.0 ? start : dist(rng));
+        }
+    }
 
-            // Total expenses that need to be offset.
-            double total_expenses = 0.0;
-            for (auto& expense : expense_models) {
-                const double this_expense = expense->update_to(year);
-                total_expenses += this_expense;
+    if (check_compressed) {
+        const Schedule reference = build_schedule(base, years, taxes);
+        Schedule test = reference;
+        std::map<const MarketData*, MarketData::Ptr> compressed;
+        for (auto& fund : test.funds) {
+            if (!fund.market) {
+                continue;
+            }
+            auto& data = compressed[fund.market];
+            if (!data) {
+                data = MarketData::compress(*fund.market);
+                std::cout << "market data: " << data->bytes() << " bytes (raw " << fund.market->bytes()
+                          << "), max price error " << data->max_error() << "\n";
+            }
+            fund.market = data.get();
+        }
+
+        const double disagreement = report_precision(std::cout,
+                                                     BatchEngine<double>(reference).run(percents),
+                                                     BatchEngine<double>(test).run(percents));
+        return disagreement > max_disagreement ? 1 : 0;
+    }
+
+    if (compressed_market) {
+        MarketFund::compress();
+    }
+
+    if (check_float32 || check_fixed_point) {
+        const Schedule schedule = build_schedule(base, years, taxes);
+        const auto reference = BatchEngine<double>(schedule).run(percents);
+        const double disagreement = check_float32
+            ? report_precision(std::cout, reference, BatchEngine<float>(schedule).run(percents))
+            : report_precision(std::cout, reference, BatchEngine<Cents>(schedule).run(percents));
+        return disagreement > max_disagreement ? 1 : 0;
+    }
 
-                if (verbose) {
-                    std::cout << this_expense << ",";
+    // Runs the schedules on the batched engine, with the requested precision, spread across the threads.
+    auto write_batched = [&](const Sweep& sweep, size_t tile, bool sweep_column) {
+        const std::vector<Schedule>& schedules = sweep.schedules;
+        if (!store.empty()) {
+            if (float32) {
+                write_store<float>(store, schedules, sweep.parameters, sweep.values, percents, tile, workers);
+            } else if (fixed_point) {
+                write_store<Cents>(store, schedules, sweep.parameters, sweep.values, percents, tile, workers);
+            } else {
+                write_store<double>(store, schedules, sweep.parameters, sweep.values, percents, tile, workers);
+            }
+            return;
+        }
+        if (!shm_ring.empty()) {
+            try {
+                ShmRingWriter ring(shm_ring, shm_ring_capacity);
+                if (float32) {
+                    publish_sweep<float>(ring, schedules, percents, tile, workers);
+                } else if (fixed_point) {
+                    publish_sweep<Cents>(ring, schedules, percents, tile, workers);
+                } else {
+                    publish_sweep<double>(ring, schedules, percents, tile, workers);
                 }
+            } catch (const std::runtime_error& ex) {
+                std::cerr << ex.what() << "\n";
+                std::exit(1);
             }
+            return;
+        }
 
-            // How much we can invest into market account and need to spend from market accounts
-            double to_invest = std::max(total_income - total_expenses, 0.0);
-            double to_spend = std::max(total_expenses - total_income, 0.0);
-            std::vector<double> market_contributed;
-            if (verbose) { market_contributed.resize(market_models.size()); }
-            for (size_t i = 0; i < market_models.size(); ++i) {
-                size_t reverse_i = market_models.size() - 1 - i;
-                market_models[reverse_i]->update_to(year);
-
-                double contributed = market_models[reverse_i]->buy(to_invest);
-                to_invest -= contributed;
-                market_contributed[reverse_i] = contributed;
+        std::cout.flush();
+        AsyncWriter::Stats stats;
+        try {
+            if (float32) {
+                stats = write_sweep<float>(
+                    STDOUT_FILENO, schedules, percents, tile, workers, sweep_column, summary, codec);
+            } else if (fixed_point) {
+                stats = write_sweep<Cents>(
+                    STDOUT_FILENO, schedules, percents, tile, workers, sweep_column, summary, codec);
+            } else {
+                stats = write_sweep<double>(
+                    STDOUT_FILENO, schedules, percents, tile, workers, sweep_column, summary, codec);
             }
-            for (size_t i = 0; i < market_models.size(); ++i) {
-                double spend = market_models[i]->sell(to_spend);
-                to_spend -= spend;
+        } catch (const std::runtime_error& ex) {
+            std::cerr << ex.what() << "\n";
+            std::exit(1);
+        }
 
-                if (verbose) {
-                    std::cout << market_contributed[i] << "," << spend << "," << market_models[i]->amount() << ",";
-                }
+        if (writer_stats) {
+            std::cerr << "writer: " << stats.buffers << " buffers, " << stats.bytes << " bytes (" << stats.raw_bytes
+                      << " uncompressed), "
+                      << stats.write_seconds << "s blocked writing, " << stats.writer_stalls
+                      << " stalls waiting on output (" << stats.stall_seconds << "s), at most " << stats.max_pending
+                      << " buffers pending\n";
+        }
+    };
+
+    // Kernels are optional, so failing to build one isn't an error, but it's worth knowing why things are slow.
+    auto report_kernels = [&]() {
+        if (const auto stats = KernelCache::stats(); stats.failed > 0) {
+            std::cerr << "kernel: " << stats.failed << " failed to build (see " << kernel_cache
+                      << "/*.log), ran the generic engine instead\n";
+        }
+    };
+
+    //
+    // Every policy runs on a copy of the same schedule (the cash flows are only worked out once), all of them together
+    // in one tile so each step's market lookups are shared. The sweep column is the policy's line in the file.
+    //
+    if (!policies.empty()) {
+        if (!sweep.empty() || verbose) {
+            parser.help("--policies compares policies on the command line scenario, not with --sweep or --verbose.");
+        }
+
+        Sweep compared;
+        try {
+            const Schedule schedule = build_schedule(base, years, taxes);
+            for (const Policy& policy : load_policies(policies, base)) {
+                compared.schedules.push_back(schedule);
+                compared.schedules.back().policy = policy;
+                compared.values.push_back({static_cast<double>(compared.values.size())});
             }
+        } catch (const std::runtime_error& ex) {
+            parser.help(ex.what());
+        }
+        compared.parameters = {"policy"};
+
+        write_batched(compared, compared.schedules.size(), true);
+        report_kernels();
+        return 0;
+    }
 
-            // Bankrupt if we haven't covered the full set of expenses.
-            if (to_spend > 0.0) {
-                bankrupt = true;
+    if (!sweep.empty()) {
+        Sweep loaded;
+        try {
+            loaded = load_sweep(sweep, argc, argv, years, taxes);
+        } catch (const std::runtime_error& ex) {
+            parser.help(ex.what());
+        }
+        const std::vector<Schedule>& schedules = loaded.schedules;
+
+        if (sweep_benchmark) {
+            std::cout << "tile,seconds,cache_misses,l1_misses\n";
+            for (size_t tile : {size_t{1}, sweep_tile}) {
+                PerfCounter cache_misses = PerfCounter::cache_misses();
+                PerfCounter l1_misses = PerfCounter::l1_misses();
+                cache_misses.start();
+                l1_misses.start();
+                const auto start_time = std::chrono::steady_clock::now();
+                run_sweep<double>(schedules, percents, tile, workers);
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+                const uint64_t l1 = l1_misses.stop();
+                const uint64_t cache = cache_misses.stop();
+
+                std::cout << tile << "," << std::setprecision(3) << std::fixed << elapsed.count() << ","
+                    << (cache_misses.available() ? std::to_string(cache) : "unavailable") << ","
+                    << (l1_misses.available() ? std::to_string(l1) : "unavailable") << "\n";
             }
+            return 0;
+        }
 
-            if (verbose) {
-                std::cout << bankrupt << "\n";
+        write_batched(loaded, sweep_tile, true);
+        report_kernels();
+        return 0;
+    }
+
+    if (!verbose && (batch || taxed || float32 || fixed_point || summary || !shm_ring.empty() || !store.empty())) {
+        Sweep single;
+        single.schedules.push_back(build_schedule(base, years, taxes));
+        single.values.emplace_back();
+        write_batched(single, 1, false);
+        report_kernels();
+        return 0;
+    }
+
+    // With --compress, the output is collected into frames of whole simulations for the writer to compress.
+    std::optional<AsyncWriter> writer;
+    std::ostringstream frame;
+    frame << std::setprecision(2);
+    std::ostream& out = codec == Codec::NONE ? std::cout : frame;
+    size_t frame_sequence = 0;
+    size_t frame_id = 0;
+    auto flush_frame = [&](size_t next_id) {
+        if (writer && frame.tellp() > 0) {
+            writer->submit(frame_sequence++, frame.str(), frame_id);
+            frame.str("");
+        }
+        frame_id = next_id;
+    };
+    if (codec != Codec::NONE) {
+        std::cout.flush();
+        writer.emplace(STDOUT_FILENO, codec);
+    }
+
+    if (verbose) {
+        out << "id,year,";
+        for (auto* models : {&base.income_models, &base.expense_models}) {
+            std::vector<std::string> names;
+            for (const auto& model : *models) {
+                names.push_back(model->name());
+            }
+            std::sort(names.begin(), names.end());
+            for (const auto& name : names) {
+                out << name << (models == &base.income_models ? "_income," : "_expense,");
             }
         }
-        
-        if (!verbose) {
-            double total_amount = 0.0;
-            for (auto& market : market_models) {
-                total_amount += market->amount();
+        for (const auto& market : base.market_models) {
+            out << market->name() << "_contributed," << market->name() << "_spending," << market->name() << "_gains,"
+                << market->name() << "_value,";
+        }
+        out << "bankrupt\n";
+    } else {
+        out << "start,final,status,retirement_value\n";
+    }
+    flush_frame(0);
+
+    for (size_t id = 0; id < percents.size(); ++id) {
+        if (frame.tellp() >= static_cast<std::streamoff>(FRAME_BYTES)) {
+            flush_frame(id);
+        }
+
+        const double percent = percents[id];
+        const ReferenceResult result = run_reference(base, years, percent, id, [&](const ReferenceStep& step) {
+            if (!verbose) {
+                return;
             }
 
-            std::cout << std::setprecision(5) << std::fixed << percent << "," << std::setprecision(2)
-                << total_amount << ","
-                << (bankrupt ? "bankrupt" : "okay") << ","
-                << retirement_value.value_or(std::numeric_limits<double>::quiet_NaN()) << "\n";
+            const double deflate = real ? step.inflation : 1.0;
+            out << id << "," << std::setprecision(5) << step.year << "," << std::fixed;
+            for (double income : step.incomes) {
+                out << income / deflate << ",";
+            }
+            for (double expense : step.expenses) {
+                out << expense / deflate << ",";
+            }
+            for (size_t i = 0; i < step.amounts.size(); ++i) {
+                out << step.contributed[i] / deflate << "," << step.spent[i] / deflate << "," << step.gains[i] / deflate
+                    << "," << step.amounts[i] / deflate << ",";
+            }
+            out << step.bankrupt << "\n";
+        });
+
+        if (!verbose) {
+            out << std::setprecision(5) << std::fixed << percent << "," << std::setprecision(2)
+                << result.final / (real ? result.inflation : 1.0) << ","
+                << (result.bankrupt ? "bankrupt" : "okay") << ","
+                << result.retirement.value_or(std::numeric_limits<double>::quiet_NaN()) /
+                       (real ? result.retirement_inflation : 1.0) << "\n";
+        }
+    }
+
+    flush_frame(percents.size());
+    if (writer) {
+        AsyncWriter::Stats stats;
+        try {
+            stats = writer->finish();
+        } catch (const std::runtime_error& ex) {
+            std::cerr << ex.what() << "\n";
+            return 1;
+        }
+        if (writer_stats) {
+            std::cerr << "writer: " << stats.buffers << " buffers, " << stats.bytes << " bytes (" << stats.raw_bytes
+                      << " uncompressed)\n";
         }
     }
 }
\ No newline at end of file
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "batch.hh"
+#include "market_data.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// market_data.bin starts in early February 1971.
+constexpr double DATA_START_YEAR = 1971.1;
+
+// Start of some well known market crises, as calendar years.
+inline const std::map<std::string, double> NAMED_WINDOWS = {
+    {"oil-crisis", 1973.0},
+    {"black-monday", 1987.75},
+    {"dotcom", 2000.2},
+    {"financial-crisis", 2007.8},
+    {"covid", 2020.1},
+};
+
+//
+// For each start day, the lowest price over the following window relative to the price on the start day (so 0.5
+// means the market halved at some point). Computed in a single pass with a sliding window minimum, reading past the
+// end of the data through the wrap-around.
+//
+inline std::vector<float> forward_drawdowns(const MarketData& market, size_t window_days) {
+    const size_t size = market.size();
+
+    std::vector<float> drawdowns(size);
+    std::deque<std::pair<size_t, double>> window;
+    for (size_t day = 1; day < size + window_days; ++day) {
+        const double price = market.lookup(day);
+        while (!window.empty() && window.back().second >= price) {
+            window.pop_back();
+        }
+        window.emplace_back(day, price);
+
+        if (day < window_days) {
+            continue;
+        }
+
+        // The window now covers (start, start + window_days]
+        const size_t start = day - window_days;
+        while (window.front().first <= start) {
+            window.pop_front();
+        }
+        drawdowns[start] = window.front().second / market.lookup(start);
+    }
+    return drawdowns;
+}
+
+//
+// Adds the worst count start days by drawdown, each at least separation days from any worse one (or any of the
+// existing starts) so a single crash doesn't take up every slot.
+//
+inline std::vector<size_t> worst_starts(const std::vector<float>& drawdowns,
+                                        size_t count,
+                                        size_t separation,
+                                        std::vector<size_t> starts = {}) {
+    std::vector<size_t> order(drawdowns.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) { return drawdowns[lhs] < drawdowns[rhs]; });
+
+    count += starts.size();
+    for (size_t day : order) {
+        if (starts.size() >= count) {
+            break;
+        }
+
+        const bool overlaps = std::any_of(starts.begin(), starts.end(), [&](size_t start) {
+            return (day > start ? day - start : start - day) < separation;
+        });
+        if (!overlaps) {
+            starts.push_back(day);
+        }
+    }
+    return starts;
+}
+
+//
+// Parses a comma separated list of named windows (see NAMED_WINDOWS) or calendar years into start days.
+//
+inline std::vector<size_t> named_starts(const std::string& names, const MarketData& market) {
+    std::vector<size_t> starts;
+
+    std::stringstream ss(names);
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+        if (name.empty()) {
+            continue;
+        }
+
+        double year = 0.0;
+        if (auto it = NAMED_WINDOWS.find(name); it != NAMED_WINDOWS.end()) {
+            year = it->second;
+        } else {
+            try {
+                year = std::stod(name);
+            } catch (const std::invalid_argument&) {
+                throw std::runtime_error("Unknown stress window '" + name + "'");
+            }
+        }
+
+        const double day = (year - DATA_START_YEAR) * 365.25;
+        if (day < 0.0 || day >= market.size()) {
+            throw std::runtime_error("Stress window '" + name + "' is outside of the market data.");
+        }
+        starts.push_back(day);
+    }
+    return starts;
+}
+
+//
+// Every start day in the data, harshest (deepest forward drawdown) first. This only depends on the data, so it is
+// worked out once and shared by everything that asks for the same window.
+//
+inline const std::vector<size_t>& harshest_order(const MarketData& market, size_t window_days) {
+    static std::mutex mutex;
+    static std::map<std::pair<const MarketData*, size_t>, std::vector<size_t>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& order = cache[{&market, window_days}];
+    if (order.empty()) {
+        const auto drawdowns = forward_drawdowns(market, window_days);
+        order.resize(drawdowns.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+            return drawdowns[lhs] < drawdowns[rhs];
+        });
+    }
+    return order;
+}
+
+struct ScreenResult {
+    bool survives = true;
+
+    // How many start days were simulated before reaching the verdict, out of the total.
+    size_t evaluated = 0;
+    size_t failures = 0;
+    size_t total = 0;
+};
+
+//
+// Checks whether a scenario survives all but a fraction (the failure budget) of the historical start days. Start days
+// are run harshest first, so a plan that doesn't survive is usually found out after a single batch.
+//
+inline ScreenResult screen(const Schedule& schedule,
+                           const MarketData& market,
+                           const std::vector<size_t>& order,
+                           double failure_budget) {
+    ScreenResult result;
+    result.total = order.size();
+    const size_t allowed = failure_budget * order.size();
+
+    const BatchEngine<double> engine(schedule);
+    std::vector<double> percents;
+    for (size_t first = 0; first < order.size(); first += BatchEngine<double>::LANES) {
+        percents.clear();
+        for (size_t i = first; i < std::min(first + BatchEngine<double>::LANES, order.size()); ++i) {
+            percents.push_back(static_cast<double>(order[i]) / market.size());
+        }
+
+        const auto results = engine.run(percents);
+        for (size_t i = 0; i < results.size(); ++i) {
+            result.evaluated++;
+            result.failures += results.bankrupt[i];
+            if (result.failures > allowed) {
+                result.survives = false;
+                return result;
+            }
+        }
+    }
+    return result;
+}
@@ -0,0 +1,362 @@
+#pragma once
+
+#include "batch.hh"
+#include "column_store.hh"
+#include "market_data.hh"
+#include "numa.hh"
+#include "output.hh"
+#include "shm_ring.hh"
+#include "writer.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Offsets per tile, enough to amortize grabbing a tile while still leaving plenty of tiles to balance the threads.
+constexpr size_t TILE_OFFSETS = 256;
+
+//
+// Runs every schedule in a sweep at every offset. The grid is split into tiles of tile_schedules schedules by a few
+// blocks of offsets: within a tile each step's market lookups are shared by all of the schedules and each schedule's
+// cash flows are read once per block of offsets, so both stay in cache while the tile runs. Tiles are handed out to
+// the threads as they finish, see Workers for how the threads are placed.
+//
+// Once a tile has run, consume(thread, schedule, first, results) is called on the thread that ran it with the
+// results of the simulations [first, first + results.size()) of that schedule. Nothing is shared between the
+// threads, so anything consume keeps should be per thread and merged once this returns.
+//
+template <typename Scalar, typename Consume>
+void for_each_tile(const std::vector<Schedule>& schedules,
+                   const std::vector<double>& percents,
+                   size_t tile_schedules,
+                   const Workers& workers,
+                   const Consume& consume) {
+    tile_schedules = std::max<size_t>(tile_schedules, 1);
+    const size_t threads = std::max<size_t>(workers.threads, 1);
+
+    auto make_engines = [&](const std::vector<Schedule>& source) {
+        std::vector<BatchEngine<Scalar>> engines;
+        for (size_t first = 0; first < source.size(); first += tile_schedules) {
+            std::vector<const Schedule*> tile;
+            for (size_t s = first; s < std::min(first + tile_schedules, source.size()); ++s) {
+                tile.push_back(&source[s]);
+            }
+            engines.emplace_back(std::move(tile));
+        }
+        return engines;
+    };
+
+    // Copies of the schedules (and the market data they read) for each node, made by the first worker on the node.
+    struct Replica {
+        std::once_flag made;
+        std::map<const MarketData*, MarketData::Ptr> markets;
+        std::vector<Schedule> schedules;
+        std::vector<BatchEngine<Scalar>> engines;
+    };
+    std::vector<Replica> replicas(workers.replicate() ? workers.topology.nodes().size() : 0);
+    std::vector<BatchEngine<Scalar>> engines;
+    if (!workers.replicate()) {
+        engines = make_engines(schedules);
+    }
+    const size_t engine_count = (schedules.size() + tile_schedules - 1) / tile_schedules;
+
+    const size_t offset_tiles = (percents.size() + TILE_OFFSETS - 1) / TILE_OFFSETS;
+    const size_t tiles = engine_count * offset_tiles;
+    std::atomic<size_t> next_tile = 0;
+
+    auto worker = [&](size_t thread) {
+        if (workers.pinned()) {
+            pin_thread(workers.topology.cpu_of(thread));
+        }
+
+        const std::vector<BatchEngine<Scalar>>* local = &engines;
+        if (workers.replicate()) {
+            Replica& replica = replicas[workers.topology.node_of(thread)];
+            std::call_once(replica.made, [&]() {
+                replica.schedules = schedules;
+                for (auto& schedule : replica.schedules) {
+                    for (auto& fund : schedule.funds) {
+                        if (fund.market) {
+                            auto& market = replica.markets[fund.market];
+                            if (!market) {
+                                market = MarketData::copy(*fund.market);
+                            }
+                            fund.market = market.get();
+                        }
+                    }
+                }
+                replica.engines = make_engines(replica.schedules);
+            });
+            local = &replica.engines;
+        }
+
+        std::vector<double> tile_percents;
+        for (size_t tile = next_tile++; tile < tiles; tile = next_tile++) {
+            // Tiles are handed out in output order (by schedule, then offset), to keep as little output as possible
+            // waiting on earlier tiles.
+            const size_t engine = tile / offset_tiles;
+            const size_t first = (tile % offset_tiles) * TILE_OFFSETS;
+            const size_t last = std::min(first + TILE_OFFSETS, percents.size());
+
+            tile_percents.assign(percents.begin() + first, percents.begin() + last);
+            auto results = (*local)[engine].run_all(tile_percents);
+            for (size_t s = 0; s < results.size(); ++s) {
+                consume(thread, engine * tile_schedules + s, first, results[s]);
+            }
+        }
+    };
+
+    // The calling thread works too, put it back where it was allowed to run once it's done.
+    cpu_set_t affinity;
+    const bool restore = workers.pinned() && sched_getaffinity(0, sizeof(affinity), &affinity) == 0;
+
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; ++t) {
+        pool.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto& thread : pool) {
+        thread.join();
+    }
+
+    if (restore) {
+        sched_setaffinity(0, sizeof(affinity), &affinity);
+    }
+}
+
+// Full results for every schedule in the sweep.
+template <typename Scalar>
+std::vector<BatchResults<Scalar>> run_sweep(const std::vector<Schedule>& schedules,
+                                            const std::vector<double>& percents,
+                                            size_t tile_schedules,
+                                            const Workers& workers) {
+    std::vector<BatchResults<Scalar>> results(schedules.size());
+    for (auto& result : results) {
+        result.final.resize(percents.size());
+        result.retirement.resize(percents.size());
+        result.bankrupt.resize(percents.size());
+    }
+
+    // Every tile writes to its own range of the results.
+    for_each_tile<Scalar>(schedules, percents, tile_schedules, workers,
+                          [&](size_t, size_t schedule, size_t first, const BatchResults<Scalar>& tile) {
+        BatchResults<Scalar>& result = results[schedule];
+        std::copy(tile.final.begin(), tile.final.end(), result.final.begin() + first);
+        std::copy(tile.retirement.begin(), tile.retirement.end(), result.retirement.begin() + first);
+        std::copy(tile.bankrupt.begin(), tile.bankrupt.end(), result.bankrupt.begin() + first);
+    });
+    return results;
+}
+
+//
+// How many tiles' output to hold for writing in order. Tiles are handed out in order, but a tile of several schedules
+// makes rows for each of them, a schedule's worth of tiles apart in the output, so the window has to reach that far
+// past the next tile to be written or the threads would all wait on one none of them has started.
+//
+inline size_t reorder_window(size_t schedules, size_t offsets, size_t tile_schedules, const Workers& workers) {
+    const size_t offset_tiles = (offsets + TILE_OFFSETS - 1) / TILE_OFFSETS;
+    const size_t spread = std::min(std::max<size_t>(tile_schedules, 1), std::max<size_t>(schedules, 1)) - 1;
+    return std::max<size_t>(AsyncWriter::DEFAULT_CAPACITY, 4 * workers.threads) + spread * offset_tiles;
+}
+
+//
+// Runs the sweep and writes either a row per simulation (prefixed with the schedule index when sweep_column is set) or
+// summary statistics per schedule to the file descriptor.
+//
+// Rows are formatted by the thread that ran each tile and handed to an AsyncWriter, which writes them in simulation
+// order on its own thread. Statistics are accumulated per tile by each thread and merged in order once every thread is
+// done. Either way the output is the same for any number of threads. With a codec, each tile's rows are compressed
+// into a frame indexed by the row's simulation id (counting through the schedules in order).
+//
+template <typename Scalar>
+AsyncWriter::Stats write_sweep(int fd,
+                               const std::vector<Schedule>& schedules,
+                               const std::vector<double>& percents,
+                               size_t tile_schedules,
+                               const Workers& workers,
+                               bool sweep_column,
+                               bool summary,
+                               Codec codec = Codec::NONE) {
+    AsyncWriter writer(fd, codec, reorder_window(schedules.size(), percents.size(), tile_schedules, workers));
+
+    if (summary) {
+        std::vector<std::vector<TileOutput>> outputs(std::max<size_t>(workers.threads, 1));
+        for_each_tile<Scalar>(schedules, percents, tile_schedules, workers,
+                              [&](size_t thread, size_t schedule, size_t first, const BatchResults<Scalar>& results) {
+            TileOutput& output = outputs[thread].emplace_back();
+            output.schedule = schedule;
+            output.first = first;
+            for (size_t i = 0; i < results.size(); ++i) {
+                output.statistics.add(Money<Scalar>::to_dollars(results.final[i]), results.bankrupt[i]);
+            }
+        });
+
+        std::vector<TileOutput> merged;
+        for (auto& thread_outputs : outputs) {
+            std::move(thread_outputs.begin(), thread_outputs.end(), std::back_inserter(merged));
+        }
+        std::sort(merged.begin(), merged.end());
+
+        std::vector<Statistics> statistics(schedules.size());
+        for (const auto& output : merged) {
+            statistics[output.schedule].merge(output.statistics);
+        }
+
+        std::string out = writer.acquire();
+        write_summary_header(out);
+        for (size_t s = 0; s < statistics.size(); ++s) {
+            format_summary(s, statistics[s], out);
+        }
+        writer.submit(0, std::move(out));
+        return writer.finish();
+    }
+
+    std::string header = writer.acquire();
+    header += sweep_column ? "sweep,start,final,status,retirement_value\n" : "start,final,status,retirement_value\n";
+    writer.submit(0, std::move(header));
+
+    const size_t offset_tiles = (percents.size() + TILE_OFFSETS - 1) / TILE_OFFSETS;
+    for_each_tile<Scalar>(schedules, percents, tile_schedules, workers,
+                          [&](size_t, size_t schedule, size_t first, const BatchResults<Scalar>& results) {
+        std::string rows = writer.acquire();
+        format_rows(percents.data() + first, results, sweep_column ? std::to_string(schedule) + "," : "", rows);
+        writer.submit(1 + schedule * offset_tiles + first / TILE_OFFSETS, std::move(rows), schedule * percents.size() + first);
+    });
+    return writer.finish();
+}
+
+//
+// Runs the sweep and publishes a record per simulation to the ring as each tile finishes (in whatever order the tiles
+// finish, each record carries its id). If the reader goes away the remaining tiles are skipped, and the error thrown
+// once they're done.
+//
+template <typename Scalar>
+void publish_sweep(ShmRingWriter& ring,
+                   const std::vector<Schedule>& schedules,
+                   const std::vector<double>& percents,
+                   size_t tile_schedules,
+                   const Workers& workers) {
+    std::mutex mutex;
+    std::exception_ptr error;
+    for_each_tile<Scalar>(schedules, percents, tile_schedules, workers,
+                          [&](size_t, size_t schedule, size_t first, const BatchResults<Scalar>& results) {
+        if (ring.failed()) {
+            return;
+        }
+        try {
+            ring.publish(results.size(), [&](size_t i, ResultRecord& record) {
+                record.id = schedule * percents.size() + first + i;
+                record.schedule = schedule;
+                record.bankrupt = results.bankrupt[i];
+                record.start = percents[first + i];
+                record.final = Money<Scalar>::to_dollars(results.final[i]);
+                record.retirement = Money<Scalar>::to_dollars(results.retirement[i]);
+            });
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    ring.close();
+}
+
+//
+// Runs the sweep and writes a row per simulation to a column store at the path, by schedule then offset. The columns
+// are the sweep line, start, final, retirement and bankrupt, then a column per sweep parameter with the schedule's
+// value. Tiles finish in any order, so each is handed to a thread of its own which appends them to the store in
+// order, keeping the disk writes off the threads running tiles (and out from under the lock they hand tiles off with).
+// As with AsyncWriter, a thread which finishes a tile too far ahead of the next to be written waits for it.
+//
+template <typename Scalar>
+void write_store(const std::string& path,
+                 const std::vector<Schedule>& schedules,
+                 const std::vector<std::string>& parameters,
+                 const std::vector<std::vector<double>>& values,
+                 const std::vector<double>& percents,
+                 size_t tile_schedules,
+                 const Workers& workers) {
+    std::vector<std::string> columns = {"sweep", "start", "final", "retirement", "bankrupt"};
+    columns.insert(columns.end(), parameters.begin(), parameters.end());
+    ColumnStoreWriter store(path, columns);
+
+    struct Finished {
+        size_t schedule = 0;
+        size_t first = 0;
+        BatchResults<Scalar> results;
+    };
+
+    const size_t offset_tiles = (percents.size() + TILE_OFFSETS - 1) / TILE_OFFSETS;
+    const size_t tiles = schedules.size() * offset_tiles;
+    const size_t window = reorder_window(schedules.size(), percents.size(), tile_schedules, workers);
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable written;
+    std::map<size_t, Finished> finished;
+    size_t next = 0;
+
+    // A failed write stops the store, the tiles still to come are dropped and the error thrown once they're done.
+    std::exception_ptr error;
+    std::thread writer([&]() {
+        std::vector<double> row(columns.size());
+        std::unique_lock<std::mutex> lock(mutex);
+        while (next < tiles) {
+            auto it = finished.find(next);
+            if (it == finished.end()) {
+                ready.wait(lock);
+                continue;
+            }
+            Finished tile = std::move(it->second);
+            finished.erase(it);
+            lock.unlock();
+
+            try {
+                std::copy(values[tile.schedule].begin(), values[tile.schedule].end(), row.begin() + 5);
+                for (size_t i = 0; i < tile.results.size(); ++i) {
+                    row[0] = tile.schedule;
+                    row[1] = percents[tile.first + i];
+                    row[2] = Money<Scalar>::to_dollars(tile.results.final[i]);
+                    row[3] = Money<Scalar>::to_dollars(tile.results.retirement[i]);
+                    row[4] = tile.results.bankrupt[i];
+                    store.append(row.data());
+                }
+            } catch (...) {
+                lock.lock();
+                error = std::current_exception();
+                written.notify_all();
+                return;
+            }
+
+            lock.lock();
+            next++;
+            written.notify_all();
+        }
+    });
+
+    for_each_tile<Scalar>(schedules, percents, tile_schedules, workers,
+                          [&](size_t, size_t schedule, size_t first, const BatchResults<Scalar>& results) {
+        const size_t sequence = schedule * offset_tiles + first / TILE_OFFSETS;
+        std::unique_lock<std::mutex> lock(mutex);
+        written.wait(lock, [&]() { return sequence < next + window || error; });
+        if (!error) {
+            finished.emplace(sequence, Finished{schedule, first, results});
+            ready.notify_one();
+        }
+    });
+    writer.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    store.close();
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// How withdrawals from a fund are taxed.
+enum class Account : uint8_t {
+    // Gains (over the average cost) are taxed as capital gains when sold.
+    TAXABLE = 0,
+    // Contributions come off taxable income, everything withdrawn is taxed as income.
+    PRETAX = 1,
+    // Contributions are made after tax, nothing is taxed when withdrawn.
+    ROTH = 2,
+};
+
+inline Account parse_account(const std::string& name) {
+    if (name == "taxable") return Account::TAXABLE;
+    if (name == "pretax") return Account::PRETAX;
+    if (name == "roth") return Account::ROTH;
+    throw std::runtime_error("Unknown account type '" + name + "', expected taxable, pretax or roth.");
+}
+
+//
+// Progressive tax brackets as a compact table. Rather than finding the bracket an income falls in, each threshold adds
+// the change in marginal rate on everything above it:
+//
+//   tax(income) = sum over k of slope[k] * max(income - threshold[k], 0)
+//
+// which has no branches and the same trip count for every income, so it evaluates across lanes as a handful of vector
+// max and multiply-adds. Unused entries have a slope of 0.
+//
+struct TaxTable {
+    static constexpr size_t MAX_BRACKETS = 8;
+
+    std::array<double, MAX_BRACKETS> thresholds{};
+    std::array<double, MAX_BRACKETS> slopes{};
+
+    //
+    // Parses "threshold:rate,..." in increasing order of threshold, for example "0:0.1,11600:0.12" taxes the first
+    // 11600 at 10% and everything after at 12%. The thresholds are of taxable income, the deduction is added to each.
+    //
+    static TaxTable parse(const std::string& brackets, double deduction) {
+        TaxTable table;
+        std::stringstream ss(brackets);
+        size_t count = 0;
+        double previous_threshold = -1.0;
+        double previous_rate = 0.0;
+        for (std::string bracket; std::getline(ss, bracket, ',');) {
+            const size_t colon = bracket.find(':');
+            double threshold = 0.0;
+            double rate = 0.0;
+            try {
+                threshold = std::stod(bracket.substr(0, colon));
+                rate = std::stod(bracket.substr(colon + 1));
+            } catch (const std::exception&) {
+                throw std::runtime_error("Unable to parse tax bracket '" + bracket + "', expected threshold:rate.");
+            }
+            if (colon == std::string::npos || threshold <= previous_threshold || count == MAX_BRACKETS) {
+                throw std::runtime_error("Tax brackets need up to " + std::to_string(MAX_BRACKETS) +
+                                         " threshold:rate pairs in increasing order, got '" + brackets + "'.");
+            }
+
+            table.thresholds[count] = threshold + deduction;
+            table.slopes[count] = rate - previous_rate;
+            previous_threshold = threshold;
+            previous_rate = rate;
+            count++;
+        }
+        return table;
+    }
+
+    double operator()(double income) const {
+        double tax = 0.0;
+        for (size_t k = 0; k < MAX_BRACKETS; ++k) {
+            tax += slopes[k] * std::max(income - thresholds[k], 0.0);
+        }
+        return tax;
+    }
+
+    // Adds sign times the tax on each income to taxes, a bracket at a time across all of them.
+    template <size_t N>
+    void accumulate(const std::array<double, N>& incomes, double sign, std::array<double, N>& taxes) const {
+        for (size_t k = 0; k < MAX_BRACKETS; ++k) {
+            const double slope = sign * slopes[k];
+            const double threshold = thresholds[k];
+            if (slope == 0.0) {
+                continue;
+            }
+            for (size_t l = 0; l < N; ++l) { taxes[l] += slope * std::max(incomes[l] - threshold, 0.0); }
+        }
+    }
+};
+
+//
+// Federal income tax for a single filer. Ordinary income (salary and pre-tax withdrawals) goes through the income
+// brackets, then capital gains are stacked on top of it through the gains brackets.
+//
+struct Taxes {
+    // 2024 brackets and standard deduction.
+    static constexpr const char* INCOME_BRACKETS =
+        "0:0.10,11600:0.12,47150:0.22,100525:0.24,191950:0.32,243725:0.35,609350:0.37";
+    static constexpr const char* GAINS_BRACKETS = "0:0,47025:0.15,518900:0.20";
+    static constexpr double DEDUCTION = 14600.0;
+
+    // A year's net capital loss comes off up to this much ordinary income, the rest carries forward.
+    static constexpr double LOSS_OFFSET = 3000.0;
+
+    TaxTable income;
+    TaxTable gains;
+
+    // Tax on a year's ordinary income plus capital gains (net of losses, see net_losses(), so never below 0).
+    double operator()(double ordinary, double gain) const {
+        gain = std::max(gain, 0.0);
+        return income(ordinary) + gains(ordinary + gain) - gains(ordinary);
+    }
+
+    //
+    // Nets a year's realized gains against the losses carried into it, for many incomes at once. A net gain is left
+    // to be taxed, while a net loss leaves no gain: it comes off up to LOSS_OFFSET of the ordinary income and the
+    // rest is carried to the next year.
+    //
+    template <size_t N>
+    static void net_losses(std::array<double, N>& ordinary,
+                           std::array<double, N>& gain,
+                           std::array<double, N>& carried) {
+        for (size_t l = 0; l < N; ++l) {
+            const double net = gain[l] - carried[l];
+            const double loss = std::max(-net, 0.0);
+            const double offset = std::min(loss, LOSS_OFFSET);
+            ordinary[l] -= offset;
+            carried[l] = loss - offset;
+            gain[l] = std::max(net, 0.0);
+        }
+    }
+
+    // The same for many incomes at once, adding to taxes (total is scratch space).
+    template <size_t N>
+    void accumulate(const std::array<double, N>& ordinary,
+                    const std::array<double, N>& gain,
+                    std::array<double, N>& total,
+                    std::array<double, N>& taxes) const {
+        for (size_t l = 0; l < N; ++l) { total[l] = ordinary[l] + gain[l]; }
+        income.accumulate(ordinary, 1.0, taxes);
+        gains.accumulate(total, 1.0, taxes);
+        gains.accumulate(ordinary, -1.0, taxes);
+    }
+};
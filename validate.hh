@@ -0,0 +1,73 @@
+#pragma once
+
+#include "batch.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+template <typename T>
+double percentile(std::vector<T> values, double percent) {
+    if (values.empty()) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    const size_t index = std::min<size_t>(percent * values.size(), values.size() - 1);
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+//
+// Compares a batch run against a reference run of the same simulations, reporting how often they disagree on
+// bankruptcy and how far apart the final values are. Returns the bankruptcy disagreement rate.
+//
+template <typename Reference, typename Test>
+double report_precision(std::ostream& os,
+                        const BatchResults<Reference>& reference,
+                        const BatchResults<Test>& test) {
+    if (reference.size() != test.size()) {
+        throw std::runtime_error("Can only compare results from the same simulations.");
+    }
+
+    std::vector<double> reference_final(reference.size());
+    std::vector<double> test_final(test.size());
+    for (size_t i = 0; i < reference.size(); ++i) {
+        reference_final[i] = Money<Reference>::to_dollars(reference.final[i]);
+        test_final[i] = Money<Test>::to_dollars(test.final[i]);
+    }
+
+    size_t disagree = 0;
+    double max_error = 0.0;
+    std::vector<double> errors;
+    errors.reserve(reference.size());
+    for (size_t i = 0; i < reference.size(); ++i) {
+        disagree += reference.bankrupt[i] != test.bankrupt[i];
+
+        const double expected = reference_final[i];
+        const double actual = test_final[i];
+        const double error = std::abs(actual - expected) / std::max(std::abs(expected), 1.0);
+        errors.push_back(error);
+        max_error = std::max(max_error, error);
+    }
+
+    const double rate = reference.size() > 0 ? static_cast<double>(disagree) / reference.size() : 0.0;
+
+    os << std::setprecision(6) << std::defaultfloat;
+    os << "simulations: " << reference.size() << "\n";
+    os << "bankrupt disagreements: " << disagree << " (" << 100.0 * rate << "%)\n";
+    os << "final value relative error: median " << percentile(errors, 0.5) << ", p99 " << percentile(errors, 0.99)
+       << ", max " << max_error << "\n";
+
+    os << "final value percentiles (reference, test, relative error):\n";
+    for (double p : {0.01, 0.05, 0.25, 0.5, 0.75, 0.95, 0.99}) {
+        const double expected = percentile(reference_final, p);
+        const double actual = percentile(test_final, p);
+        os << "\tp" << std::setw(2) << std::left << static_cast<int>(100 * p) << std::right << std::fixed
+           << std::setprecision(2) << std::setw(16) << expected << std::setw(16) << actual << std::defaultfloat
+           << std::setprecision(6) << std::setw(14) << std::abs(actual - expected) / std::max(std::abs(expected), 1.0)
+           << "\n";
+    }
+
+    return rate;
+}
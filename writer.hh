@@ -0,0 +1,234 @@
+#pragma once
+
+#include "compress.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+//
+// Writes buffers to a file descriptor from its own thread, in order of their sequence numbers, so the threads
+// producing output hand off a filled buffer and carry on rather than waiting on a slow disk or pipe. Written buffers
+// are kept (with their capacity) to be handed out again.
+//
+// Only buffers within capacity of the next one to be written are taken, a producer further ahead waits in submit()
+// for the writer to catch up. That bounds the memory held however slow the output is. The capacity has to cover how
+// far ahead of the order producers can get while the next buffer is still to be made, or they'd wait on each other.
+//
+// With a codec, each buffer is compressed into its own frame (see compress.hh) by the thread submitting it, so the
+// compression is spread over the producing threads, and the frame index is written once everything else has been.
+//
+class AsyncWriter {
+public:
+    struct Stats {
+        size_t buffers = 0;
+        size_t bytes = 0;
+
+        // Bytes submitted, before compression.
+        size_t raw_bytes = 0;
+
+        // Time the writer spent blocked in write(), where producers writing inline would have stalled.
+        double write_seconds = 0.0;
+
+        // How often a producer had to wait for the writer to catch up, and for how long.
+        size_t writer_stalls = 0;
+        double stall_seconds = 0.0;
+
+        // How often the writer went idle waiting on the next buffer in sequence, and the most buffers waiting to be
+        // written at once.
+        size_t writer_idle = 0;
+        size_t max_pending = 0;
+    };
+
+    // Enough for a few buffers per producing thread, so producers only wait when the output really can't keep up.
+    static constexpr size_t DEFAULT_CAPACITY = 64;
+
+    explicit AsyncWriter(int fd, Codec codec = Codec::NONE, size_t capacity = DEFAULT_CAPACITY)
+        : fd_(fd), codec_(codec), capacity_(std::max<size_t>(capacity, 1)), thread_([this]() { run(); }) {}
+    ~AsyncWriter() { stop(); }
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+public:
+    // An empty buffer to fill.
+    std::string acquire() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.empty()) {
+            return {};
+        }
+        std::string buffer = std::move(free_.back());
+        free_.pop_back();
+        buffer.clear();
+        return buffer;
+    }
+
+    // Hands off a filled buffer, it is written once every buffer with a lower sequence number has been (waiting if it's
+    // too far ahead of those). When compressing, first_id is the first simulation in the buffer, for the frame index.
+    void submit(size_t sequence, std::string buffer, uint64_t first_id = 0) {
+        const size_t raw_size = buffer.size();
+        if (codec_ != Codec::NONE) {
+            std::string frame = acquire();
+            compress_frame(codec_, first_id, buffer, frame);
+            std::swap(buffer, frame);
+            release(std::move(frame));
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (sequence >= next_ + capacity_) {
+                stats_.writer_stalls++;
+                const auto start = std::chrono::steady_clock::now();
+                written_.wait(lock, [&]() { return sequence < next_ + capacity_; });
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                stats_.stall_seconds += elapsed.count();
+            }
+            stats_.raw_bytes += raw_size;
+            pending_.emplace(sequence, std::move(buffer));
+            stats_.max_pending = std::max(stats_.max_pending, pending_.size());
+        }
+        ready_.notify_one();
+    }
+
+    //
+    // Waits for every submitted buffer to be written. Sequence numbers must have been contiguous from 0. Throws if
+    // the output couldn't be written (other than there being nothing reading it anymore).
+    //
+    Stats finish() {
+        stop();
+        if (error_ != 0) {
+            throw std::runtime_error(std::string("Unable to write the output: ") + std::strerror(error_));
+        }
+        return stats_;
+    }
+
+private:
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+        }
+        ready_.notify_one();
+        if (thread_.joinable()) {
+            thread_.join();
+
+            if (codec_ != Codec::NONE) {
+                write_index();
+            }
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            auto next = pending_.find(next_);
+            if (next == pending_.end()) {
+                if (done_) {
+                    return;
+                }
+                stats_.writer_idle++;
+                ready_.wait(lock);
+                continue;
+            }
+
+            std::string buffer = std::move(next->second);
+            if (codec_ != Codec::NONE) {
+                FrameHeader header;
+                std::memcpy(&header, buffer.data(), sizeof(header));
+                index_.push_back({header.first_id, offset_, header.raw_size, header.size});
+            }
+            offset_ += buffer.size();
+            pending_.erase(next);
+            next_++;
+            written_.notify_all();
+
+            // Producers only need the lock to hand off buffers, never while the write is happening.
+            lock.unlock();
+            const auto start = std::chrono::steady_clock::now();
+            write_all(buffer);
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            lock.lock();
+
+            stats_.buffers++;
+            stats_.bytes += buffer.size();
+            stats_.write_seconds += elapsed.count();
+            free_.push_back(std::move(buffer));
+        }
+    }
+
+    void release(std::string buffer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(std::move(buffer));
+    }
+
+    // The index of every frame, then the footer pointing back at it.
+    void write_index() {
+        FrameHeader header;
+        header.magic = INDEX_MAGIC;
+        header.size = index_.size() * sizeof(IndexEntry);
+        header.first_id = index_.size();
+
+        Footer footer;
+        footer.index_offset = offset_;
+
+        std::string out(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.append(reinterpret_cast<const char*>(index_.data()), header.size);
+        out.append(reinterpret_cast<const char*>(&footer), sizeof(footer));
+        write_all(out);
+        stats_.bytes += out.size();
+    }
+
+    // Once a write fails the rest are dropped, the error (unless it was just the reader going away) is kept for
+    // finish() to throw.
+    void write_all(const std::string& buffer) {
+        const char* data = buffer.data();
+        size_t remaining = buffer.size();
+        while (remaining > 0 && !failed_) {
+            const ssize_t written = ::write(fd_, data, remaining);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                error_ = errno == EPIPE ? 0 : errno;
+                failed_ = true;
+                return;
+            }
+            data += written;
+            remaining -= written;
+        }
+    }
+
+private:
+    const int fd_;
+    const Codec codec_;
+    const size_t capacity_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable written_;
+    std::map<size_t, std::string> pending_;
+    std::vector<std::string> free_;
+    size_t next_ = 0;
+    bool done_ = false;
+
+    // Only touched by the writer thread (until it's joined).
+    uint64_t offset_ = 0;
+    std::vector<IndexEntry> index_;
+    bool failed_ = false;
+    int error_ = 0;
+
+    Stats stats_;
+
+    // Last so everything else is set up before the thread starts.
+    std::thread thread_;
+};